@@ -6,9 +6,65 @@
  *  License at the end of file.
  */
 
+#if defined(__unix__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     // fileno, fdatasync and O_DIRECT, even with -std=c99
+#endif
+
 #include "sd_io.h"
 
+#ifdef SD_IO_WRITE_BYTES
+/******************************************************************************
+ Private Methods Prototypes - Coalescing write buffer
+******************************************************************************/
+
+/**
+    \brief Forget every buffered sector and clear the counters.
+    \param dev Device descriptor.
+ */
+void __SD_WBuf_Reset (SD_DEV *dev);
+
+/**
+    \brief Look for the slot holding a sector.
+    \param dev Device descriptor.
+    \param sector Sector number.
+    \return Slot index, or SD_IO_WBUF_COUNT if the sector isn't buffered.
+ */
+BYTE __SD_WBuf_Find (SD_DEV *dev, DWORD sector);
+
+/**
+    \brief Program a slot on the card if it is dirty.
+    \param dev Device descriptor.
+    \param slot Slot index.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_WBuf_Flush (SD_DEV *dev, BYTE slot);
+#endif
+
 #ifdef _M_IX86  // For use over x86
+#include <stdlib.h>
+#include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <io.h>
+#endif
+#if defined(SD_IO_ASYNC) || defined(SD_IO_GROUP_COMMIT)
+#include <pthread.h>
+#endif
+#ifdef SD_IO_GROUP_COMMIT
+#include <time.h>
+#endif
+#ifdef SD_IO_ASYNC
+#include <fcntl.h>
+#ifdef __linux__
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
 /*****************************************************************************/
 /* Private Methods Prototypes - Direct work with PC file                     */
 /*****************************************************************************/
@@ -20,6 +76,308 @@
  */
 DWORD __SD_Sectors (SD_DEV* dev);
 
+/**
+ * \brief Load a little-endian double word.
+ * \param p Pointer to the first byte.
+ * \return Value.
+ */
+DWORD __SD_Ld_Dword (const BYTE *p);
+
+/**
+ * \brief Store a little-endian double word.
+ * \param p Pointer to the first byte.
+ * \param val Value.
+ */
+void __SD_St_Dword (BYTE *p, DWORD val);
+
+/**
+ * \brief Read from a file at a given position.
+ * \param fp File.
+ * \param pos Byte position from the start of the file.
+ * \param dat Destination.
+ * \param cnt Byte count.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_File_Read (FILE *fp, long pos, void *dat, DWORD cnt);
+
+/**
+ * \brief Write to a file at a given position.
+ * \param fp File.
+ * \param pos Byte position from the start of the file.
+ * \param dat Source.
+ * \param cnt Byte count.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_File_Write (FILE *fp, long pos, const void *dat, DWORD cnt);
+
+/**
+ * \brief Read from a sector of the image in «fn», whatever its format.
+ * \param dev Device descriptor.
+ * \param sector Sector number.
+ * \param ofs Byte offset in the sector.
+ * \param dat Destination.
+ * \param cnt Byte count.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Image_Read (SD_DEV *dev, DWORD sector, WORD ofs, void *dat, WORD cnt);
+
+/**
+ * \brief Write a sector of the image in «fn», whatever its format.
+ * \param dev Device descriptor.
+ * \param sector Sector number.
+ * \param dat Source, SD_BLK_SIZE bytes.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Image_Write (SD_DEV *dev, DWORD sector, const void *dat);
+
+#ifdef SD_IO_SPARSE
+/**
+ * \brief Detect a sparse image in «fn» and load its chunk map.
+ * \param dev Device descriptor, with the image already open.
+ * \return SD_OK for a valid sparse image or a raw one.
+ */
+SDRESULTS __SD_Sparse_Open (SD_DEV *dev);
+
+/**
+ * \brief Write the header and the chunk map of a sparse image.
+ * \param fp File.
+ * \param sp Geometry of the image.
+ * \param map Chunk map.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Sparse_Format (FILE *fp, const SD_SPARSE *sp, const BYTE *map);
+
+/**
+ * \brief Update an entry of the chunk map, in memory and in the file.
+ * \param dev Device descriptor.
+ * \param chunk Chunk number.
+ * \param loc Sector in the file where the chunk starts, zero if unallocated.
+ * \param len Compressed byte count, zero if stored raw.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Sparse_Entry (SD_DEV *dev, DWORD chunk, DWORD loc, DWORD len);
+
+/**
+ * \brief Decompress a chunk into «zbuf», unless it is already there.
+ * \param dev Device descriptor.
+ * \param chunk Chunk number, must be compressed.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Sparse_Load (SD_DEV *dev, DWORD chunk);
+
+/**
+ * \brief Read from a sector of a sparse image.
+ */
+SDRESULTS __SD_Sparse_Read (SD_DEV *dev, DWORD sector, WORD ofs, void *dat, WORD cnt);
+
+/**
+ * \brief Write a sector of a sparse image.
+ */
+SDRESULTS __SD_Sparse_Write (SD_DEV *dev, DWORD sector, const void *dat);
+
+/**
+ * \brief Check if a buffer holds only zeroes.
+ * \param dat Buffer.
+ * \param cnt Byte count.
+ * \return TRUE if every byte is zero.
+ */
+BOOL __SD_Is_Zero (const BYTE *dat, DWORD cnt);
+
+/**
+ * \brief Compress a buffer with a small LZ77 coder.
+ * \param src Source.
+ * \param cnt Source byte count (up to 64 KB).
+ * \param dst Destination.
+ * \param max Destination size.
+ * \return Compressed byte count, zero if it doesn't fit in «max».
+ */
+DWORD __SD_LZ_Pack (const BYTE *src, DWORD cnt, BYTE *dst, DWORD max);
+
+/**
+ * \brief Decompress a buffer made by __SD_LZ_Pack.
+ * \param src Source.
+ * \param cnt Source byte count.
+ * \param dst Destination.
+ * \param max Destination size.
+ * \return Decompressed byte count, zero if the source is corrupt.
+ */
+DWORD __SD_LZ_Unpack (const BYTE *src, DWORD cnt, BYTE *dst, DWORD max);
+#endif
+
+#ifdef SD_IO_ASYNC
+/* Request of the asynchronous engine */
+typedef struct _SD_AREQ {
+    void *tag;          /* Given back by SD_Reap        */
+    BYTE *dat;          /* Caller's buffer              */
+    BYTE *buf;          /* Aligned buffer (O_DIRECT)    */
+    DWORD sector;
+    BOOL write;
+    SDRESULTS res;
+#ifdef __linux__
+    struct iovec iov;   /* READV/WRITEV, valid until reaped */
+#endif
+} SD_AREQ;
+
+/* State of the asynchronous engine */
+struct _SD_ASYNC {
+    int fd;             /* Own descriptor of «fn», -1 in synchronous mode */
+    BYTE flags;
+    WORD depth;
+    SD_AREQ *req;       /* «depth» requests                     */
+    WORD *slot;         /* Free requests (stack)                */
+    WORD nfree;
+    WORD *ready;        /* Done requests, ring of «depth»       */
+    WORD rhead, rcnt;
+    BYTE *bufs;         /* «depth» aligned sectors (O_DIRECT)   */
+#ifdef __linux__
+    int ring;           /* io_uring descriptor, -1 if not used  */
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqe_len;
+    struct io_uring_sqe *sqes;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    WORD unsubmitted;   /* Entries queued since the last enter  */
+#endif
+    pthread_t *thr;     /* Thread pool, when io_uring is not available */
+    WORD nthr;
+    WORD *queue;        /* Requests waiting for a thread, ring of «depth» */
+    WORD qhead, qcnt;
+    WORD busy;          /* Requests taken by a thread           */
+    BOOL stop;
+    BOOL failed;        /* io_uring_enter failed, no new requests */
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+};
+
+/**
+ * \brief Queue a request on the engine in use.
+ * \param dev Device descriptor.
+ * \param dat Caller's buffer.
+ * \param sector Sector number.
+ * \param tag Given back by SD_Reap.
+ * \param write TRUE for a write.
+ * \return SD_OK, SD_BUSY if «depth» requests are in flight.
+ */
+SDRESULTS __SD_Async_Submit (SD_DEV *dev, void *dat, DWORD sector, void *tag, BOOL write);
+
+/**
+ * \brief Run a request with pread/pwrite and set its result.
+ * \param aio Engine.
+ * \param rq Request.
+ */
+void __SD_Async_Run (struct _SD_ASYNC *aio, SD_AREQ *rq);
+
+/**
+ * \brief Body of the threads of the pool.
+ * \param arg Engine.
+ */
+void *__SD_Async_Worker (void *arg);
+
+#ifdef __linux__
+/**
+ * \brief Set up an io_uring of «depth» entries, registering the buffers.
+ * \param aio Engine.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Uring_Open (struct _SD_ASYNC *aio);
+
+/**
+ * \brief Submit the queued entries and move completions to the ready ring.
+ * Called with «lock» held, it is released during the system call.
+ * \param aio Engine.
+ * \param wait TRUE to block until at least one completion.
+ * \return If all goes well returns SD_OK, SD_ERROR marks the engine failed.
+ */
+SDRESULTS __SD_Uring_Enter (struct _SD_ASYNC *aio, BOOL wait);
+#endif
+#endif
+
+/**
+ * \brief Push stdio buffers of the image files to the kernel.
+ * \param dev Device descriptor.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Sync_Buffers (SD_DEV *dev);
+
+/**
+ * \brief Make the data of a file durable (fdatasync, fsync or _commit,
+ * depending on the host).
+ * \param fp File, its stdio buffer already flushed.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Sync_File (FILE *fp);
+
+/**
+ * \brief Make the data of the image files durable.
+ * \param dev Device descriptor.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Sync_Files (SD_DEV *dev);
+
+#ifdef SD_IO_GROUP_COMMIT
+/* State of group commit */
+/* Clock of the deadlines: monotonic where the condition can be set to it */
+#if defined(_POSIX_CLOCK_SELECTION) && (_POSIX_CLOCK_SELECTION > 0)
+#define SD_GROUP_CLOCK CLOCK_MONOTONIC
+#else
+#define SD_GROUP_CLOCK CLOCK_REALTIME
+#endif
+
+struct _SD_GROUP {
+    WORD count;         /* Writes that close a batch            */
+    DWORD usec;         /* Age of the oldest write closing it   */
+    DWORD issued;       /* Writes done so far                   */
+    DWORD durable;      /* Writes covered by a finished sync    */
+    WORD pending;       /* Writes waiting for the next sync     */
+    BOOL syncing;       /* A caller is running the sync         */
+    SDRESULTS res;      /* Sticky: a failed sync loses the data */
+    struct timespec first;  /* Oldest pending write             */
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+#endif
+
+#ifdef SD_IO_OVERLAY
+/**
+ * \brief Open the delta file of the overlay, creating it if missing.
+ * \param dev Device descriptor, with the base image already open.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Overlay_Open (SD_DEV *dev);
+
+/**
+ * \brief Truncate the delta file and write an empty sector map.
+ * \param dev Device descriptor.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Overlay_Create (SD_DEV *dev);
+
+/**
+ * \brief Check if a sector lives in the delta file.
+ * \param dev Device descriptor.
+ * \param sector Sector number.
+ * \return TRUE if the sector was written since the delta was created.
+ */
+BOOL __SD_Overlay_Has (SD_DEV *dev, DWORD sector);
+
+/**
+ * \brief Byte position of a sector inside the delta file.
+ * \param dev Device descriptor.
+ * \param sector Sector number.
+ * \return Position from the start of the file.
+ */
+long __SD_Overlay_Pos (SD_DEV *dev, DWORD sector);
+
+/**
+ * \brief Record in the sector map that a sector lives in the delta file.
+ * \param dev Device descriptor.
+ * \param sector Sector number.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Overlay_Mark (SD_DEV *dev, DWORD sector);
+#endif
+
 /*****************************************************************************/
 /* Private Methods - Direct work with PC file                                */
 /*****************************************************************************/
@@ -27,12 +385,652 @@ DWORD __SD_Sectors (SD_DEV* dev);
 DWORD __SD_Sectors (SD_DEV *dev)
 {
     if (dev->fp == NULL) return(0); // Fail
+#ifdef SD_IO_SPARSE
+    else if (dev->sp.map != NULL) return(dev->sp.sectors - 1);
+#endif
     else {
         fseek(dev->fp, 0L, SEEK_END);
         return (((DWORD)(ftell(dev->fp)))/((DWORD)512)-1);
     }
 }
+
+DWORD __SD_Ld_Dword (const BYTE *p)
+{
+    DWORD val;
+    val = p[3];
+    val = (val << 8) | p[2];
+    val = (val << 8) | p[1];
+    val = (val << 8) | p[0];
+    return(val);
+}
+
+void __SD_St_Dword (BYTE *p, DWORD val)
+{
+    p[0] = (BYTE)(val >> 0 );
+    p[1] = (BYTE)(val >> 8 );
+    p[2] = (BYTE)(val >> 16);
+    p[3] = (BYTE)(val >> 24);
+}
+
+SDRESULTS __SD_File_Read (FILE *fp, long pos, void *dat, DWORD cnt)
+{
+    if((fp == NULL)||(fseek(fp, pos, SEEK_SET) != 0)) return(SD_ERROR);
+    return((fread(dat, 1, cnt, fp) == cnt) ? SD_OK : SD_ERROR);
+}
+
+SDRESULTS __SD_File_Write (FILE *fp, long pos, const void *dat, DWORD cnt)
+{
+    if((fp == NULL)||(fseek(fp, pos, SEEK_SET) != 0)) return(SD_ERROR);
+    return((fwrite(dat, 1, cnt, fp) == cnt) ? SD_OK : SD_ERROR);
+}
+
+SDRESULTS __SD_Image_Read (SD_DEV *dev, DWORD sector, WORD ofs, void *dat, WORD cnt)
+{
+#ifdef SD_IO_SPARSE
+    if(dev->sp.map != NULL) return(__SD_Sparse_Read(dev, sector, ofs, dat, cnt));
+#endif
+    return(__SD_File_Read(dev->fp, (long)sector * SD_BLK_SIZE + ofs, dat, cnt));
+}
+
+SDRESULTS __SD_Image_Write (SD_DEV *dev, DWORD sector, const void *dat)
+{
+#ifdef SD_IO_SPARSE
+    if(dev->sp.map != NULL) return(__SD_Sparse_Write(dev, sector, dat));
+#endif
+    return(__SD_File_Write(dev->fp, (long)sector * SD_BLK_SIZE, dat, SD_BLK_SIZE));
+}
+
+#ifdef SD_IO_SPARSE
+/*
+ * Sparse image layout, in 512-byte units:
+ * - Header: magic, virtual sectors, sectors per chunk, chunks, map size.
+ * - Chunk map: 8 bytes per chunk, the sector where the chunk starts in the
+ *   file (zero: unallocated, reads as zeroes) and its compressed byte count
+ *   (zero: stored raw).
+ * - Data: chunks in allocation order. Raw chunks are rewritten in place,
+ *   a write to a compressed one moves it raw to the end of the file.
+ */
+#define SD_SPARSE_MAGIC     "ulibSDsp"
+#define SD_SPARSE_MAX_CHUNK 128     /* LZ offsets are 16-bit */
+
+#if (SD_IO_SPARSE_CHUNK < 1) || (SD_IO_SPARSE_CHUNK > SD_SPARSE_MAX_CHUNK)
+#error "SD_IO_SPARSE_CHUNK must be between 1 and 128"
+#endif
+
+SDRESULTS __SD_Sparse_Open (SD_DEV *dev)
+{
+    BYTE hdr[SD_BLK_SIZE];
+    DWORD chunk, loc, len;
+    long end;
+    dev->sp.map = NULL;
+    dev->sp.hot = NULL;
+    dev->sp.zbuf = NULL;
+    if((__SD_File_Read(dev->fp, 0, hdr, SD_BLK_SIZE) != SD_OK)
+        ||(memcmp(hdr, SD_SPARSE_MAGIC, 8) != 0))
+        return(SD_OK);  // Raw image
+    dev->sp.sectors = __SD_Ld_Dword(hdr + 8);
+    dev->sp.chunk = __SD_Ld_Dword(hdr + 12);
+    dev->sp.chunks = __SD_Ld_Dword(hdr + 16);
+    dev->sp.mapsec = __SD_Ld_Dword(hdr + 20);
+    if((dev->sp.sectors == 0)||(dev->sp.chunk == 0)
+        ||(dev->sp.chunk > SD_SPARSE_MAX_CHUNK)
+        ||(dev->sp.chunks != (dev->sp.sectors + dev->sp.chunk - 1) / dev->sp.chunk)
+        ||(dev->sp.mapsec != (dev->sp.chunks * 8 + SD_BLK_SIZE - 1) / SD_BLK_SIZE))
+        return(SD_ERROR);
+    dev->sp.map = malloc((size_t)dev->sp.mapsec * SD_BLK_SIZE);
+    dev->sp.hot = calloc((dev->sp.chunks + 7) / 8, 1);
+    dev->sp.zbuf = malloc((size_t)dev->sp.chunk * SD_BLK_SIZE);
+    dev->sp.zchunk = dev->sp.chunks;
+    if((dev->sp.map == NULL)||(dev->sp.hot == NULL)||(dev->sp.zbuf == NULL))
+        return(SD_ERROR);
+    if(__SD_File_Read(dev->fp, SD_BLK_SIZE, dev->sp.map,
+        (DWORD)dev->sp.mapsec * SD_BLK_SIZE) != SD_OK)
+        return(SD_ERROR);
+    // Data can't overlap the header or the map, and packed chunks are smaller
+    for(chunk=0; chunk!=dev->sp.chunks; chunk++) {
+        loc = __SD_Ld_Dword(dev->sp.map + chunk * 8);
+        len = __SD_Ld_Dword(dev->sp.map + chunk * 8 + 4);
+        if(((loc != 0)&&(loc < 1 + dev->sp.mapsec))
+            ||((loc == 0)&&(len != 0))
+            ||(len > dev->sp.chunk * SD_BLK_SIZE))
+            return(SD_ERROR);
+    }
+    // New chunks are appended at the end of the file
+    if(fseek(dev->fp, 0L, SEEK_END) != 0) return(SD_ERROR);
+    end = ftell(dev->fp);
+    dev->sp.next = (DWORD)((end + SD_BLK_SIZE - 1) / SD_BLK_SIZE);
+    if(dev->sp.next < 1 + dev->sp.mapsec) dev->sp.next = 1 + dev->sp.mapsec;
+    return(SD_OK);
+}
+
+SDRESULTS __SD_Sparse_Format (FILE *fp, const SD_SPARSE *sp, const BYTE *map)
+{
+    BYTE hdr[SD_BLK_SIZE];
+    memset(hdr, 0, SD_BLK_SIZE);
+    memcpy(hdr, SD_SPARSE_MAGIC, 8);
+    __SD_St_Dword(hdr + 8, sp->sectors);
+    __SD_St_Dword(hdr + 12, sp->chunk);
+    __SD_St_Dword(hdr + 16, sp->chunks);
+    __SD_St_Dword(hdr + 20, sp->mapsec);
+    if((__SD_File_Write(fp, 0, hdr, SD_BLK_SIZE) != SD_OK)
+        ||(__SD_File_Write(fp, SD_BLK_SIZE, map, (DWORD)sp->mapsec * SD_BLK_SIZE) != SD_OK)
+        ||(fflush(fp) != 0))
+        return(SD_ERROR);
+    return(SD_OK);
+}
+
+SDRESULTS __SD_Sparse_Entry (SD_DEV *dev, DWORD chunk, DWORD loc, DWORD len)
+{
+    BYTE *ent;
+    ent = dev->sp.map + chunk * 8;
+    __SD_St_Dword(ent, loc);
+    __SD_St_Dword(ent + 4, len);
+    return(__SD_File_Write(dev->fp, SD_BLK_SIZE + (long)chunk * 8, ent, 8));
+}
+
+SDRESULTS __SD_Sparse_Load (SD_DEV *dev, DWORD chunk)
+{
+    BYTE *pk;
+    DWORD loc, len, n;
+    if(dev->sp.zchunk == chunk) return(SD_OK);
+    loc = __SD_Ld_Dword(dev->sp.map + chunk * 8);
+    len = __SD_Ld_Dword(dev->sp.map + chunk * 8 + 4);
+    n = dev->sp.chunk * SD_BLK_SIZE;
+    // Raw chunk or bad entry: nothing to unpack
+    if((len == 0)||(len > n)||(loc < 1 + dev->sp.mapsec)) return(SD_ERROR);
+    pk = malloc(len);
+    if(pk == NULL) return(SD_ERROR);
+    dev->sp.zchunk = dev->sp.chunks;
+    if((__SD_File_Read(dev->fp, (long)loc * SD_BLK_SIZE, pk, len) != SD_OK)
+        ||(__SD_LZ_Unpack(pk, len, dev->sp.zbuf, n) != n))
+    {
+        free(pk);
+        return(SD_ERROR);
+    }
+    free(pk);
+    dev->sp.zchunk = chunk;
+    return(SD_OK);
+}
+
+SDRESULTS __SD_Sparse_Read (SD_DEV *dev, DWORD sector, WORD ofs, void *dat, WORD cnt)
+{
+    DWORD chunk, loc, len, idx;
+    chunk = sector / dev->sp.chunk;
+    idx = sector % dev->sp.chunk;
+    loc = __SD_Ld_Dword(dev->sp.map + chunk * 8);
+    len = __SD_Ld_Dword(dev->sp.map + chunk * 8 + 4);
+    // Unallocated chunks read as zeroes without touching the file
+    if(loc == 0) {
+        memset(dat, 0, cnt);
+        return(SD_OK);
+    }
+    if(len == 0)
+        return(__SD_File_Read(dev->fp, ((long)loc + idx) * SD_BLK_SIZE + ofs, dat, cnt));
+    if(__SD_Sparse_Load(dev, chunk) != SD_OK) return(SD_ERROR);
+    memcpy(dat, dev->sp.zbuf + idx * SD_BLK_SIZE + ofs, cnt);
+    return(SD_OK);
+}
+
+SDRESULTS __SD_Sparse_Write (SD_DEV *dev, DWORD sector, const void *dat)
+{
+    DWORD chunk, loc, len, idx, n;
+    BOOL zero;
+    chunk = sector / dev->sp.chunk;
+    idx = sector % dev->sp.chunk;
+    loc = __SD_Ld_Dword(dev->sp.map + chunk * 8);
+    len = __SD_Ld_Dword(dev->sp.map + chunk * 8 + 4);
+    n = dev->sp.chunk * SD_BLK_SIZE;
+    zero = __SD_Is_Zero(dat, SD_BLK_SIZE);
+    // Zeroes over an unallocated chunk only need the map entry it already has
+    if((loc == 0)&&zero) return(SD_OK);
+    dev->sp.hot[chunk >> 3] |= (1 << (chunk & 7));
+    if(len != 0)
+    {
+        // Compressed: move it raw to the end of the file with the new sector
+        if(__SD_Sparse_Load(dev, chunk) != SD_OK) return(SD_ERROR);
+        memcpy(dev->sp.zbuf + idx * SD_BLK_SIZE, dat, SD_BLK_SIZE);
+        dev->sp.zchunk = dev->sp.chunks;
+        if(__SD_File_Write(dev->fp, (long)dev->sp.next * SD_BLK_SIZE, dev->sp.zbuf, n) != SD_OK)
+            return(SD_ERROR);
+    }
+    else if(loc == 0)
+    {
+        // Unallocated: the rest of the chunk is a hole of zeroes
+        if((__SD_File_Write(dev->fp, ((long)dev->sp.next + idx) * SD_BLK_SIZE, dat, SD_BLK_SIZE) != SD_OK)
+            ||((idx != dev->sp.chunk - 1)&&(__SD_File_Write(dev->fp,
+                ((long)dev->sp.next + dev->sp.chunk) * SD_BLK_SIZE - 1, "", 1) != SD_OK)))
+            return(SD_ERROR);
+    }
+    else
+    {
+        // Raw: rewrite in place, and drop the chunk if it became all zeroes
+        if(__SD_File_Write(dev->fp, ((long)loc + idx) * SD_BLK_SIZE, dat, SD_BLK_SIZE) != SD_OK)
+            return(SD_ERROR);
+        if(!zero) return(SD_OK);
+        dev->sp.zchunk = dev->sp.chunks;
+        if(__SD_File_Read(dev->fp, (long)loc * SD_BLK_SIZE, dev->sp.zbuf, n) != SD_OK)
+            return(SD_ERROR);
+        if(!__SD_Is_Zero(dev->sp.zbuf, n)) return(SD_OK);
+        return(__SD_Sparse_Entry(dev, chunk, 0, 0));
+    }
+    dev->sp.next += dev->sp.chunk;
+    return(__SD_Sparse_Entry(dev, chunk, dev->sp.next - dev->sp.chunk, 0));
+}
+
+BOOL __SD_Is_Zero (const BYTE *dat, DWORD cnt)
+{
+    while(cnt--) if(*dat++) return(FALSE);
+    return(TRUE);
+}
+
+/*
+ * LZ stream: a control byte «c» below 0x80 is followed by c+1 literals.
+ * Otherwise it is a match of (c & 0x7F)+3 bytes, followed by the 16-bit
+ * little-endian distance back into the output.
+ */
+#define SD_LZ_MIN_MATCH 3
+#define SD_LZ_MAX_MATCH (0x7F + SD_LZ_MIN_MATCH)
+#define SD_LZ_HASH_BITS 12
+
+DWORD __SD_LZ_Pack (const BYTE *src, DWORD cnt, BYTE *dst, DWORD max)
+{
+    DWORD head[1 << SD_LZ_HASH_BITS];   // Last position + 1 of each hash
+    DWORD ip, op, lit, h, cand, len;
+    memset(head, 0, sizeof(head));
+    ip = 0;
+    op = 0;
+    lit = 0;    // Pending literals end at «ip»
+    while(ip < cnt)
+    {
+        len = 0;
+        if(ip + SD_LZ_MIN_MATCH <= cnt)
+        {
+            h = ((DWORD)src[ip] << 8) ^ ((DWORD)src[ip + 1] << 4) ^ src[ip + 2];
+            h = (h * 2654435761UL) >> (32 - SD_LZ_HASH_BITS);
+            h &= (1 << SD_LZ_HASH_BITS) - 1;
+            cand = head[h];
+            head[h] = ip + 1;
+            if(cand && (ip - (cand - 1) <= 0xFFFF))
+            {
+                cand--;
+                while((ip + len < cnt)&&(len < SD_LZ_MAX_MATCH)
+                    &&(src[cand + len] == src[ip + len]))
+                    len++;
+            }
+        }
+        if(len < SD_LZ_MIN_MATCH)
+        {
+            ip++;
+            lit++;
+            if((lit == 0x80)||(ip == cnt))
+            {
+                if(op + 1 + lit > max) return(0);
+                dst[op++] = (BYTE)(lit - 1);
+                memcpy(dst + op, src + ip - lit, lit);
+                op += lit;
+                lit = 0;
+            }
+            continue;
+        }
+        if(lit)
+        {
+            if(op + 1 + lit > max) return(0);
+            dst[op++] = (BYTE)(lit - 1);
+            memcpy(dst + op, src + ip - lit, lit);
+            op += lit;
+            lit = 0;
+        }
+        if(op + 3 > max) return(0);
+        dst[op++] = (BYTE)(0x80 | (len - SD_LZ_MIN_MATCH));
+        dst[op++] = (BYTE)((ip - cand) >> 0);
+        dst[op++] = (BYTE)((ip - cand) >> 8);
+        ip += len;
+    }
+    return(op);
+}
+
+DWORD __SD_LZ_Unpack (const BYTE *src, DWORD cnt, BYTE *dst, DWORD max)
+{
+    DWORD ip, op, len, dist;
+    ip = 0;
+    op = 0;
+    while(ip < cnt)
+    {
+        if(src[ip] < 0x80)
+        {
+            len = src[ip++] + 1;
+            if((ip + len > cnt)||(op + len > max)) return(0);
+            memcpy(dst + op, src + ip, len);
+            ip += len;
+        }
+        else
+        {
+            len = (src[ip++] & 0x7F) + SD_LZ_MIN_MATCH;
+            if(ip + 2 > cnt) return(0);
+            dist = src[ip] | ((DWORD)src[ip + 1] << 8);
+            ip += 2;
+            if((dist == 0)||(dist > op)||(op + len > max)) return(0);
+            // Byte by byte: the match may overlap its own output
+            while(len--) { dst[op] = dst[op - dist]; op++; }
+            continue;
+        }
+        op += len;
+    }
+    return(op);
+}
+#endif
+
+#ifdef SD_IO_ASYNC
+void __SD_Async_Run (struct _SD_ASYNC *aio, SD_AREQ *rq)
+{
+    BYTE *buf;
+    ssize_t n;
+    buf = (aio->flags & SD_ASYNC_DIRECT) ? rq->buf : rq->dat;
+    if(rq->write) {
+        if(buf != rq->dat) memcpy(buf, rq->dat, SD_BLK_SIZE);
+        n = pwrite(aio->fd, buf, SD_BLK_SIZE, (off_t)rq->sector * SD_BLK_SIZE);
+    } else {
+        n = pread(aio->fd, buf, SD_BLK_SIZE, (off_t)rq->sector * SD_BLK_SIZE);
+        if((n == SD_BLK_SIZE)&&(buf != rq->dat)) memcpy(rq->dat, buf, SD_BLK_SIZE);
+    }
+    rq->res = (n == SD_BLK_SIZE) ? SD_OK : SD_ERROR;
+}
+
+void *__SD_Async_Worker (void *arg)
+{
+    struct _SD_ASYNC *aio = arg;
+    WORD id;
+    pthread_mutex_lock(&aio->lock);
+    for(;;) {
+        while((aio->qcnt == 0)&&(!aio->stop)) pthread_cond_wait(&aio->work, &aio->lock);
+        if(aio->qcnt == 0) break;
+        id = aio->queue[aio->qhead];
+        aio->qhead = (aio->qhead + 1) % aio->depth;
+        aio->qcnt--;
+        aio->busy++;
+        pthread_mutex_unlock(&aio->lock);
+        __SD_Async_Run(aio, &aio->req[id]);
+        pthread_mutex_lock(&aio->lock);
+        aio->busy--;
+        aio->ready[(aio->rhead + aio->rcnt) % aio->depth] = id;
+        aio->rcnt++;
+        pthread_cond_signal(&aio->done);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return(NULL);
+}
+
+#ifdef __linux__
+SDRESULTS __SD_Uring_Open (struct _SD_ASYNC *aio)
+{
+    struct io_uring_params p;
+    struct iovec *iov;
+    WORD idx;
+    long rc;
+    memset(&p, 0, sizeof(p));
+    aio->ring = (int)syscall(__NR_io_uring_setup, aio->depth, &p);
+    if(aio->ring < 0) return(SD_ERROR);
+    aio->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    aio->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    aio->sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sq_ptr = mmap(NULL, aio->sq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, aio->ring, IORING_OFF_SQ_RING);
+    aio->cq_ptr = mmap(NULL, aio->cq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, aio->ring, IORING_OFF_CQ_RING);
+    aio->sqes = mmap(NULL, aio->sqe_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, aio->ring, IORING_OFF_SQES);
+    if((aio->sq_ptr == MAP_FAILED)||(aio->cq_ptr == MAP_FAILED)||(aio->sqes == MAP_FAILED))
+        return(SD_ERROR);
+    aio->sq_head = (unsigned *)((BYTE *)aio->sq_ptr + p.sq_off.head);
+    aio->sq_tail = (unsigned *)((BYTE *)aio->sq_ptr + p.sq_off.tail);
+    aio->sq_mask = (unsigned *)((BYTE *)aio->sq_ptr + p.sq_off.ring_mask);
+    aio->sq_array = (unsigned *)((BYTE *)aio->sq_ptr + p.sq_off.array);
+    aio->cq_head = (unsigned *)((BYTE *)aio->cq_ptr + p.cq_off.head);
+    aio->cq_tail = (unsigned *)((BYTE *)aio->cq_ptr + p.cq_off.tail);
+    aio->cq_mask = (unsigned *)((BYTE *)aio->cq_ptr + p.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *)((BYTE *)aio->cq_ptr + p.cq_off.cqes);
+    aio->unsubmitted = 0;
+    if(!(aio->flags & SD_ASYNC_DIRECT)) return(SD_OK);
+    // Pin the aligned buffers once, requests then use READ_FIXED/WRITE_FIXED
+    iov = malloc(aio->depth * sizeof(struct iovec));
+    if(iov == NULL) return(SD_ERROR);
+    for(idx=0; idx!=aio->depth; idx++) {
+        iov[idx].iov_base = aio->req[idx].buf;
+        iov[idx].iov_len = SD_BLK_SIZE;
+    }
+    rc = syscall(__NR_io_uring_register, aio->ring, IORING_REGISTER_BUFFERS, iov, aio->depth);
+    free(iov);
+    return((rc < 0) ? SD_ERROR : SD_OK);
+}
+
+SDRESULTS __SD_Uring_Enter (struct _SD_ASYNC *aio, BOOL wait)
+{
+    struct io_uring_cqe *cqe;
+    SD_AREQ *rq;
+    unsigned head;
+    WORD cnt;
+    long rc;
+    // One syscall submits everything queued and, if asked, waits. Other
+    // threads may submit meanwhile
+    if(aio->unsubmitted || wait) {
+        cnt = aio->unsubmitted;
+        pthread_mutex_unlock(&aio->lock);
+        do {
+            rc = syscall(__NR_io_uring_enter, aio->ring, cnt, wait ? 1 : 0,
+                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        } while((rc < 0)&&(errno == EINTR));
+        pthread_mutex_lock(&aio->lock);
+        if(rc < 0) {
+            aio->failed = TRUE;
+            return(SD_ERROR);
+        }
+        aio->unsubmitted -= (WORD)rc;
+    }
+    head = *aio->cq_head;
+    while(head != __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &aio->cqes[head & *aio->cq_mask];
+        rq = &aio->req[cqe->user_data];
+        rq->res = (cqe->res == SD_BLK_SIZE) ? SD_OK : SD_ERROR;
+        if((rq->res == SD_OK)&&(!rq->write)&&(aio->flags & SD_ASYNC_DIRECT))
+            memcpy(rq->dat, rq->buf, SD_BLK_SIZE);
+        aio->ready[(aio->rhead + aio->rcnt) % aio->depth] = (WORD)cqe->user_data;
+        aio->rcnt++;
+        head++;
+    }
+    __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+    return(SD_OK);
+}
+#endif
+
+SDRESULTS __SD_Async_Submit (SD_DEV *dev, void *dat, DWORD sector, void *tag, BOOL write)
+{
+    struct _SD_ASYNC *aio = dev->aio;
+    SD_AREQ *rq;
+    WORD id;
+#ifdef __linux__
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+#endif
+#ifdef SD_IO_WRITE_BYTES
+    BYTE slot;
+#endif
+    if(aio == NULL) return(SD_NOINIT);
+    if(sector > dev->last_sector) return(SD_PARERR);
+#ifdef SD_IO_WRITE_BYTES
+    // The engine's descriptor doesn't see the coalescing buffer: program the
+    // sector first, and drop the copy a write is about to supersede
+    slot = __SD_WBuf_Find(dev, sector);
+    if((aio->fd >= 0)&&(slot != SD_IO_WBUF_COUNT)) {
+        if(__SD_WBuf_Flush(dev, slot) != SD_OK) return(SD_ERROR);
+        if(write) dev->wbuf[slot].valid = FALSE;
+    }
+#endif
+    // Data written with SD_Write may still be in the stdio buffer
+    if((aio->fd >= 0)&&(fflush(dev->fp) != 0)) return(SD_ERROR);
+    pthread_mutex_lock(&aio->lock);
+    if(aio->failed) {
+        pthread_mutex_unlock(&aio->lock);
+        return(SD_ERROR);
+    }
+    if(aio->nfree == 0) {
+        pthread_mutex_unlock(&aio->lock);
+        return(SD_BUSY);    // Reap first
+    }
+    id = aio->slot[--aio->nfree];
+    rq = &aio->req[id];
+    rq->tag = tag;
+    rq->dat = dat;
+    rq->sector = sector;
+    rq->write = write;
+    if(aio->fd < 0) {
+        // Synchronous mode: done right now, reported by the next SD_Reap
+        rq->res = write ? SD_Write(dev, dat, sector) : SD_Read(dev, dat, sector, 0, SD_BLK_SIZE);
+        aio->ready[(aio->rhead + aio->rcnt) % aio->depth] = id;
+        aio->rcnt++;
+    }
+#ifdef __linux__
+    else if(aio->ring >= 0) {
+        if(write && (aio->flags & SD_ASYNC_DIRECT)) memcpy(rq->buf, dat, SD_BLK_SIZE);
+        tail = *aio->sq_tail;
+        idx = tail & *aio->sq_mask;
+        sqe = &aio->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = aio->fd;
+        sqe->off = (unsigned long long)sector * SD_BLK_SIZE;
+        sqe->user_data = id;
+        if(aio->flags & SD_ASYNC_DIRECT) {
+            sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->addr = (unsigned long)rq->buf;
+            sqe->len = SD_BLK_SIZE;
+            sqe->buf_index = id;
+        } else {
+            // READ/WRITE need 5.6, READV/WRITEV work since io_uring exists
+            rq->iov.iov_base = dat;
+            rq->iov.iov_len = SD_BLK_SIZE;
+            sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->addr = (unsigned long)&rq->iov;
+            sqe->len = 1;
+        }
+        aio->sq_array[idx] = idx;
+        __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        aio->unsubmitted++;
+    }
+#endif
+    else {
+        aio->queue[(aio->qhead + aio->qcnt) % aio->depth] = id;
+        aio->qcnt++;
+        pthread_cond_signal(&aio->work);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return(SD_OK);
+}
+#endif
+
+SDRESULTS __SD_Sync_Buffers (SD_DEV *dev)
+{
+#ifdef SD_IO_OVERLAY
+    // The base is read-only while there is a delta
+    if(dev->ofp != NULL) return((fflush(dev->ofp) == 0) ? SD_OK : SD_ERROR);
+#endif
+    return((fflush(dev->fp) == 0) ? SD_OK : SD_ERROR);
+}
+
+SDRESULTS __SD_Sync_File (FILE *fp)
+{
+#if defined(__unix__) && defined(_POSIX_SYNCHRONIZED_IO) && (_POSIX_SYNCHRONIZED_IO > 0)
+    return((fdatasync(fileno(fp)) == 0) ? SD_OK : SD_ERROR);
+#elif defined(__unix__) || defined(__APPLE__)
+    return((fsync(fileno(fp)) == 0) ? SD_OK : SD_ERROR);
+#elif defined(_WIN32)
+    return((_commit(_fileno(fp)) == 0) ? SD_OK : SD_ERROR);
+#else
+    // ISO C can't reach the medium: the data is only handed to the system
+    return((fflush(fp) == 0) ? SD_OK : SD_ERROR);
+#endif
+}
+
+SDRESULTS __SD_Sync_Files (SD_DEV *dev)
+{
+#ifdef SD_IO_OVERLAY
+    if(dev->ofp != NULL) return(__SD_Sync_File(dev->ofp));
+#endif
+    return(__SD_Sync_File(dev->fp));
+}
+
+#ifdef SD_IO_OVERLAY
+/*
+ * Delta file layout, in 512-byte units:
+ * - Header: magic, sectors of the base image, size of the sector map.
+ * - Sector map: one bit per sector of the base image, set if it lives here.
+ * - Data: sector «n» at «n» past the map. Unwritten sectors are never
+ *   touched, so the file stays sparse on any filesystem with holes.
+ */
+#define SD_OVL_MAGIC    "ulibSDov"
+
+SDRESULTS __SD_Overlay_Open (SD_DEV *dev)
+{
+    BYTE hdr[SD_BLK_SIZE];
+    DWORD sectors;
+    sectors = dev->last_sector + 1;
+    dev->mapsec = ((sectors + 7) / 8 + SD_BLK_SIZE - 1) / SD_BLK_SIZE;
+    dev->map = calloc(dev->mapsec, SD_BLK_SIZE);
+    if(dev->map == NULL) return(SD_ERROR);
+    dev->ofp = fopen(dev->ovl, "r+b");
+    if(dev->ofp == NULL) return(__SD_Overlay_Create(dev));
+    // An existing delta must belong to a base of the same size
+    if((fread(hdr, 1, SD_BLK_SIZE, dev->ofp) != SD_BLK_SIZE)
+        ||(memcmp(hdr, SD_OVL_MAGIC, 8) != 0)
+        ||(__SD_Ld_Dword(hdr + 8) != sectors)
+        ||(__SD_Ld_Dword(hdr + 12) != dev->mapsec))
+        return(SD_ERROR);
+    if(fread(dev->map, SD_BLK_SIZE, dev->mapsec, dev->ofp) != dev->mapsec)
+        return(SD_ERROR);
+    return(SD_OK);
+}
+
+SDRESULTS __SD_Overlay_Create (SD_DEV *dev)
+{
+    BYTE hdr[SD_BLK_SIZE];
+    if(dev->ofp != NULL) fclose(dev->ofp);
+    dev->ofp = fopen(dev->ovl, "w+b");
+    if(dev->ofp == NULL) return(SD_ERROR);
+    memset(dev->map, 0, (size_t)dev->mapsec * SD_BLK_SIZE);
+    memset(hdr, 0, SD_BLK_SIZE);
+    memcpy(hdr, SD_OVL_MAGIC, 8);
+    __SD_St_Dword(hdr + 8, dev->last_sector + 1);
+    __SD_St_Dword(hdr + 12, dev->mapsec);
+    if((fwrite(hdr, 1, SD_BLK_SIZE, dev->ofp) != SD_BLK_SIZE)
+        ||(fwrite(dev->map, SD_BLK_SIZE, dev->mapsec, dev->ofp) != dev->mapsec)
+        ||(fflush(dev->ofp) != 0))
+        return(SD_ERROR);
+    return(SD_OK);
+}
+
+BOOL __SD_Overlay_Has (SD_DEV *dev, DWORD sector)
+{
+    if(dev->map == NULL) return(FALSE);
+    return((dev->map[sector >> 3] & (1 << (sector & 7))) ? TRUE : FALSE);
+}
+
+long __SD_Overlay_Pos (SD_DEV *dev, DWORD sector)
+{
+    return(((long)1 + dev->mapsec + sector) * SD_BLK_SIZE);
+}
+
+SDRESULTS __SD_Overlay_Mark (SD_DEV *dev, DWORD sector)
+{
+    if(__SD_Overlay_Has(dev, sector)) return(SD_OK);
+    dev->map[sector >> 3] |= (1 << (sector & 7));
+    // Data is already in place, persist the map byte that points to it
+    if((fseek(dev->ofp, SD_BLK_SIZE + (long)(sector >> 3), SEEK_SET) != 0)
+        ||(fputc(dev->map[sector >> 3], dev->ofp) == EOF))
+        return(SD_ERROR);
+    return(SD_OK);
+}
+#endif
 #else   // For use with uControllers   
+#include <stddef.h>
+
 /******************************************************************************
  Private Methods Prototypes - Direct work with SD card
 ******************************************************************************/
@@ -75,6 +1073,13 @@ BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg);
  */
 SDRESULTS __SD_Write_Block(SD_DEV *dev, void *dat, BYTE token);
 
+/**
+    \brief Finish a data block already sent: check the data response and
+    wait for the end of programming.
+    \param token Token that started the block.
+ */
+SDRESULTS __SD_Write_Wait(SD_DEV *dev, BYTE token);
+
 /**
     \brief Get the total numbers of sectors in SD card.
     \param dev Device descriptor.
@@ -82,6 +1087,22 @@ SDRESULTS __SD_Write_Block(SD_DEV *dev, void *dat, BYTE token);
  */
 DWORD __SD_Sectors (SD_DEV *dev);
 
+#ifdef SD_IO_TRACE
+/**
+    \brief Record an event in the trace ring, if there is one.
+    \param type Event type (SD_TRC_*).
+    \param cmd Command index.
+    \param res R1 response or data response.
+    \param tkn Data token.
+    \param arg Command argument or sector.
+    \param wait Polls spent waiting.
+ */
+void __SD_Trace_Put (BYTE type, BYTE cmd, BYTE res, BYTE tkn, DWORD arg, DWORD wait);
+
+/* Ring in use, NULL when not recording */
+static SD_TRACE *__SD_Trace_Ring = NULL;
+#endif
+
 /******************************************************************************
  Private Methods - Direct work with SD card
 ******************************************************************************/
@@ -110,6 +1131,9 @@ void __SD_Speed_Transfer(BYTE throttle) {
 BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg)
 {
     BYTE crc, res;
+#ifdef SD_IO_TRACE
+    DWORD wait = 0;
+#endif
     // ACMD«n» is the command sequense of CMD55-CMD«n»
     if(cmd & 0x80) {
         cmd &= 0x7F;
@@ -141,8 +1165,14 @@ BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg)
     SPI_Timer_On(5);
     do {
         res = SPI_RW(0xFF);
+#ifdef SD_IO_TRACE
+        wait++;
+#endif
     } while((res & 0x80)&&(SPI_Timer_Status()==TRUE));
     SPI_Timer_Off();
+#ifdef SD_IO_TRACE
+    __SD_Trace_Put(SD_TRC_CMD, cmd & 0x3F, res, 0, arg, wait);
+#endif
     // Return with the response value
     return(res);
 }
@@ -150,7 +1180,6 @@ BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg)
 SDRESULTS __SD_Write_Block(SD_DEV *dev, void *dat, BYTE token)
 {
     WORD idx;
-    BYTE line;
     // Send token (single or multiple)
     SPI_RW(token);
     // Single block write?
@@ -161,20 +1190,52 @@ SDRESULTS __SD_Write_Block(SD_DEV *dev, void *dat, BYTE token)
         /* Dummy CRC */
         SPI_RW(0xFF);
         SPI_RW(0xFF);
+    }
+    return(__SD_Write_Wait(dev, token));
+}
+
+SDRESULTS __SD_Write_Wait(SD_DEV *dev, BYTE token)
+{
+    BYTE line, resp;
+#ifdef SD_IO_TRACE
+    DWORD wait = 0;
+#endif
+    resp = 0;
+    if(token != 0xFD)
+    {
         // If not accepted, returns the reject error
-        if((SPI_RW(0xFF) & 0x1F) != 0x05) return(SD_REJECT);
+        resp = SPI_RW(0xFF) & 0x1F;
+        if(resp != 0x05) {
+#ifdef SD_IO_TRACE
+            __SD_Trace_Put(SD_TRC_WRITE, 0, resp, token, 0, 0);
+#endif
+            return(SD_REJECT);
+        }
     }
 #ifdef SD_IO_WRITE_WAIT_BLOCKER
     // Waits until finish of data programming (blocked)
-    while(SPI_RW(0xFF)==0);
+    while(SPI_RW(0xFF)==0) {
+#ifdef SD_IO_TRACE
+        wait++;
+#endif
+    }
+#ifdef SD_IO_TRACE
+    __SD_Trace_Put(SD_TRC_WRITE, 0, resp, token, 0, wait);
+#endif
     return(SD_OK);
 #else
     // Waits until finish of data programming with a timeout
     SPI_Timer_On(SD_IO_WRITE_TIMEOUT_WAIT);
     do {
         line = SPI_RW(0xFF);
+#ifdef SD_IO_TRACE
+        wait++;
+#endif
     } while((line==0)&&(SPI_Timer_Status()==TRUE));
     SPI_Timer_Off();
+#ifdef SD_IO_TRACE
+    __SD_Trace_Put(SD_TRC_WRITE, 0, resp, token, 0, wait);
+#endif
 #ifdef SD_IO_DBG_COUNT
     dev->debug.write++;
 #endif
@@ -234,8 +1295,70 @@ DWORD __SD_Sectors (SD_DEV *dev)
         return (ss);
     } else return (0); // Error
 }
+
+#ifdef SD_IO_TRACE
+void __SD_Trace_Put (BYTE type, BYTE cmd, BYTE res, BYTE tkn, DWORD arg, DWORD wait)
+{
+    SD_TRACE *trc;
+    volatile SD_TRACE_EVT *evt;
+    trc = __SD_Trace_Ring;
+    if(trc == NULL) return;
+    // Full ring: keep the oldest events, the consumer owns them
+    if((WORD)(trc->head - trc->tail) > trc->mask) {
+        trc->lost++;
+        return;
+    }
+    evt = &trc->evt[trc->head & trc->mask];
+    evt->type = type;
+    evt->cmd = cmd;
+    evt->res = res;
+    evt->tkn = tkn;
+    evt->arg = arg;
+    evt->wait = wait;
+    // Publish only once the event is complete. The fields are volatile, so
+    // the compiler can't move their stores past this one
+    trc->head++;
+}
+#endif
 #endif // Private methods for uC
 
+#ifdef SD_IO_WRITE_BYTES
+/******************************************************************************
+ Private Methods - Coalescing write buffer
+******************************************************************************/
+
+void __SD_WBuf_Reset (SD_DEV *dev)
+{
+    BYTE idx;
+    for(idx=0; idx!=SD_IO_WBUF_COUNT; idx++) {
+        dev->wbuf[idx].valid = FALSE;
+        dev->wbuf[idx].dirty = FALSE;
+    }
+    dev->wbtick = 0;
+    dev->wbcount.patches = 0;
+    dev->wbcount.programs = 0;
+    dev->wbcount.saved = 0;
+}
+
+BYTE __SD_WBuf_Find (SD_DEV *dev, DWORD sector)
+{
+    BYTE idx;
+    for(idx=0; idx!=SD_IO_WBUF_COUNT; idx++)
+        if(dev->wbuf[idx].valid && (dev->wbuf[idx].sector == sector)) break;
+    return(idx);
+}
+
+SDRESULTS __SD_WBuf_Flush (SD_DEV *dev, BYTE slot)
+{
+    SDRESULTS res;
+    if(!dev->wbuf[slot].dirty) return(SD_OK);
+    // SD_Write clears dirty once the card has the data
+    res = SD_Write(dev, dev->wbuf[slot].data, dev->wbuf[slot].sector);
+    if(res == SD_OK) dev->wbcount.programs++;
+    return(res);
+}
+#endif // Private methods for coalescing write buffer
+
 /******************************************************************************
  Public Methods - Direct work with SD card
 ******************************************************************************/
@@ -243,12 +1366,42 @@ DWORD __SD_Sectors (SD_DEV *dev)
 SDRESULTS SD_Init(SD_DEV *dev)
 {
 #if defined(_M_IX86)    // x86 
+#ifdef SD_IO_OVERLAY
+    dev->ofp = NULL;
+    dev->map = NULL;
+    // With a delta file the base image is never modified
+    dev->fp = fopen(dev->fn, (dev->ovl[0] ? "rb" : "r+"));
+#else
     dev->fp = fopen(dev->fn, "r+");
+#endif
     if (dev->fp == NULL)
         return (SD_ERROR);
     else
     {
+#ifdef SD_IO_ASYNC
+        dev->aio = NULL;
+#endif
+#ifdef SD_IO_GROUP_COMMIT
+        dev->grp = NULL;
+#endif
+#ifdef SD_IO_WRITE_BYTES
+        __SD_WBuf_Reset(dev);
+#endif
+#ifdef SD_IO_SPARSE
+        if (__SD_Sparse_Open(dev) != SD_OK)
+        {
+            SD_Close(dev);
+            return (SD_ERROR);
+        }
+#endif
         dev->last_sector = __SD_Sectors(dev);
+#ifdef SD_IO_OVERLAY
+        if (dev->ovl[0] && (__SD_Overlay_Open(dev) != SD_OK))
+        {
+            SD_Close(dev);
+            return (SD_ERROR);
+        }
+#endif
 #ifdef SD_IO_DBG_COUNT
         dev->debug.read = 0;
         dev->debug.write = 0;
@@ -326,6 +1479,9 @@ SDRESULTS SD_Init(SD_DEV *dev)
         dev->cardtype = ct;
         dev->mount = TRUE;
         dev->last_sector = __SD_Sectors(dev) - 1;
+#ifdef SD_IO_WRITE_BYTES
+        __SD_WBuf_Reset(dev);
+#endif
 #ifdef SD_IO_DBG_COUNT
         dev->debug.read = 0;
         dev->debug.write = 0;
@@ -339,30 +1495,47 @@ SDRESULTS SD_Init(SD_DEV *dev)
 
 SDRESULTS SD_Read(SD_DEV *dev, void *dat, DWORD sector, WORD ofs, WORD cnt)
 {
+#ifdef SD_IO_WRITE_BYTES
+    BYTE slot;
+    // A buffered sector may be newer than the card
+    if((sector <= dev->last_sector)&&(cnt != 0))
+    {
+        slot = __SD_WBuf_Find(dev, sector);
+        if(slot != SD_IO_WBUF_COUNT)
+        {
+            if((ofs + cnt) > SD_BLK_SIZE) return(SD_PARERR);
+            dev->wbuf[slot].stamp = ++dev->wbtick;
+            do {
+                *(BYTE*)dat = dev->wbuf[slot].data[ofs++];
+                dat++;
+            } while(--cnt);
+            return(SD_OK);
+        }
+    }
+#endif
 #if defined(_M_IX86)    // x86
+    SDRESULTS res;
     // Check the sector query
     if((sector > dev->last_sector)||(cnt == 0)) return(SD_PARERR);
-    if(dev->fp!=NULL)
-    {
-        if (fseek(dev->fp, ((512 * sector) + ofs), SEEK_SET)!=0)
-            return(SD_ERROR);
-        else {
-            if(fread(dat, 1, (cnt - ofs),dev->fp)==(cnt - ofs))
-            {
-#ifdef SD_IO_DBG_COUNT
-                dev->debug.read++;
+    if(dev->fp == NULL) return(SD_ERROR);
+#ifdef SD_IO_OVERLAY
+    // Sectors written since the delta was created are read from it
+    if(__SD_Overlay_Has(dev, sector))
+        res = __SD_File_Read(dev->ofp, __SD_Overlay_Pos(dev, sector) + ofs, dat, cnt);
+    else
 #endif
-                return(SD_OK);
-            }
-            else return(SD_ERROR);
-        }
-    } else {
-        return(SD_ERROR);
-    }
+    res = __SD_Image_Read(dev, sector, ofs, dat, cnt);
+#ifdef SD_IO_DBG_COUNT
+    if(res == SD_OK) dev->debug.read++;
+#endif
+    return(res);
 #else   // uControllers
     SDRESULTS res;
     BYTE tkn;
     WORD remaining;
+#ifdef SD_IO_TRACE
+    DWORD wait = 0;
+#endif
     res = SD_ERROR;
     if ((sector > dev->last_sector)||(cnt == 0)) return(SD_PARERR);
     // Convert sector number to byte address (sector * SD_BLK_SIZE)
@@ -370,8 +1543,14 @@ SDRESULTS SD_Read(SD_DEV *dev, void *dat, DWORD sector, WORD ofs, WORD cnt)
         SPI_Timer_On(100);  // Wait for data packet (timeout of 100ms)
         do {
             tkn = SPI_RW(0xFF);
+#ifdef SD_IO_TRACE
+            wait++;
+#endif
         } while((tkn==0xFF)&&(SPI_Timer_Status()==TRUE));
         SPI_Timer_Off();
+#ifdef SD_IO_TRACE
+        __SD_Trace_Put(SD_TRC_READ, 0, 0, tkn, sector, wait);
+#endif
         // Token of single block?
         if(tkn==0xFE) { 
             // Size block (512 bytes) + CRC (2 bytes) - offset - bytes to count
@@ -405,45 +1584,787 @@ SDRESULTS SD_Read(SD_DEV *dev, void *dat, DWORD sector, WORD ofs, WORD cnt)
 #ifdef SD_IO_WRITE
 SDRESULTS SD_Write(SD_DEV *dev, void *dat, DWORD sector)
 {
+    SDRESULTS res;
+#ifdef SD_IO_WRITE_BYTES
+    BYTE slot;
+    WORD idx;
+#endif
 #if defined(_M_IX86)    // x86
     // Query ok?
     if(sector > dev->last_sector) return(SD_PARERR);
-    if(dev->fp != NULL)
+    if(dev->fp == NULL) return(SD_ERROR);
+#ifdef SD_IO_OVERLAY
+    // All writes go to the delta file when there is one
+    if(dev->ofp != NULL)
     {
-        if(fseek(dev->fp, SD_BLK_SIZE * sector, SEEK_SET)!=0)
-            return(SD_ERROR);
-        else {
-            if(fwrite(dat, 1, SD_BLK_SIZE, dev->fp)==SD_BLK_SIZE)
-            {
+        res = __SD_File_Write(dev->ofp, __SD_Overlay_Pos(dev, sector), dat, SD_BLK_SIZE);
+        if(res == SD_OK) res = __SD_Overlay_Mark(dev, sector);
+    }
+    else
+#endif
+    res = __SD_Image_Write(dev, sector, dat);
 #ifdef SD_IO_DBG_COUNT
-                dev->debug.write++;
+    if(res == SD_OK) dev->debug.write++;
 #endif
-                return(SD_OK);
-            }
-            else return(SD_ERROR);
-        }
-    } else return(SD_ERROR);
 #else   // uControllers
     // Query ok?
     if(sector > dev->last_sector) return(SD_PARERR);
     // Single block write (token <- 0xFE)
     // Convert sector number to bytes address (sector * SD_BLK_SIZE)
     if(__SD_Send_Cmd(CMD24, sector * SD_BLK_SIZE)==0)
-        return(__SD_Write_Block(dev, dat, 0xFE));
+        res = __SD_Write_Block(dev, dat, 0xFE);
     else
-        return(SD_ERROR);
+        res = SD_ERROR;
+#endif
+#ifdef SD_IO_WRITE_BYTES
+    // A whole sector write supersedes any buffered copy once it is on the
+    // card. On failure the slot keeps what the card is known to hold
+    slot = __SD_WBuf_Find(dev, sector);
+    if((res == SD_OK) && (slot != SD_IO_WBUF_COUNT))
+    {
+        if(dev->wbuf[slot].data != (BYTE*)dat)
+        {
+            for(idx=0; idx!=SD_BLK_SIZE; idx++)
+                dev->wbuf[slot].data[idx] = *((BYTE*)dat + idx);
+        }
+        dev->wbuf[slot].dirty = FALSE;
+    }
+#endif
+    return(res);
+}
+#endif
+
+#ifdef SD_IO_WRITE_BYTES
+SDRESULTS SD_WriteBytes(SD_DEV *dev, void *dat, DWORD sector, WORD ofs, WORD cnt)
+{
+    SDRESULTS res;
+    BYTE slot, idx;
+    WORD age, oldest;
+    // Query ok?
+    if((sector > dev->last_sector)||(cnt == 0)||((ofs + cnt) > SD_BLK_SIZE))
+        return(SD_PARERR);
+    slot = __SD_WBuf_Find(dev, sector);
+    if(slot == SD_IO_WBUF_COUNT)
+    {
+        // Miss: evict the least recently used slot (a free one goes first)
+        slot = 0;
+        oldest = 0;
+        for(idx=0; idx!=SD_IO_WBUF_COUNT; idx++)
+        {
+            if(!dev->wbuf[idx].valid) { slot = idx; break; }
+            age = dev->wbtick - dev->wbuf[idx].stamp;
+            if(age >= oldest) { oldest = age; slot = idx; }
+        }
+        res = __SD_WBuf_Flush(dev, slot);
+        if(res != SD_OK) return(res);
+        dev->wbuf[slot].valid = FALSE;
+        // Fetch the current contents unless the patch covers all of them
+        if(cnt != SD_BLK_SIZE)
+        {
+            res = SD_Read(dev, dev->wbuf[slot].data, sector, 0, SD_BLK_SIZE);
+            if(res != SD_OK) return(res);
+        }
+        dev->wbuf[slot].sector = sector;
+        dev->wbuf[slot].valid = TRUE;
+    }
+    else if(dev->wbuf[slot].dirty) dev->wbcount.saved++;
+    dev->wbuf[slot].stamp = ++dev->wbtick;
+    dev->wbuf[slot].dirty = TRUE;
+    dev->wbcount.patches++;
+    do {
+        dev->wbuf[slot].data[ofs++] = *(BYTE*)dat;
+        dat++;
+    } while(--cnt);
+    return(SD_OK);
+}
+
+SDRESULTS SD_Flush(SD_DEV *dev)
+{
+    SDRESULTS res;
+    BYTE idx;
+    for(idx=0; idx!=SD_IO_WBUF_COUNT; idx++)
+    {
+        res = __SD_WBuf_Flush(dev, idx);
+        if(res != SD_OK) return(res);
+    }
+    return(SD_OK);
+}
+#endif
+
+#ifdef SD_IO_STREAM
+SDRESULTS SD_ReadStream(SD_DEV *dev, DWORD sector, SD_SINK sink, void *ctx)
+{
+    WORD ofs;
+#if defined(_M_IX86)
+    BYTE blk[SD_BLK_SIZE];
+#else
+    BYTE chunk[SD_IO_STREAM_CHUNK];
+    SDRESULTS res;
+    BYTE tkn;
+    WORD idx;
+#ifdef SD_IO_TRACE
+    DWORD wait = 0;
+#endif
+#endif
+#ifdef SD_IO_WRITE_BYTES
+    BYTE slot;
+#endif
+    if(sector > dev->last_sector) return(SD_PARERR);
+#ifdef SD_IO_WRITE_BYTES
+    // A buffered sector may be newer than the card
+    slot = __SD_WBuf_Find(dev, sector);
+    if(slot != SD_IO_WBUF_COUNT)
+    {
+        dev->wbuf[slot].stamp = ++dev->wbtick;
+        for(ofs=0; ofs!=SD_BLK_SIZE; ofs+=SD_IO_STREAM_CHUNK)
+            sink(ctx, dev->wbuf[slot].data + ofs, SD_IO_STREAM_CHUNK);
+        return(SD_OK);
+    }
+#endif
+#if defined(_M_IX86)    // x86
+    // As in SD_WriteStream, one access to the image for the whole block
+    if(SD_Read(dev, blk, sector, 0, SD_BLK_SIZE) != SD_OK) return(SD_ERROR);
+    for(ofs=0; ofs!=SD_BLK_SIZE; ofs+=SD_IO_STREAM_CHUNK)
+        sink(ctx, blk + ofs, SD_IO_STREAM_CHUNK);
+    return(SD_OK);
+#else   // uControllers
+    res = SD_ERROR;
+    // Convert sector number to byte address (sector * SD_BLK_SIZE)
+    if (__SD_Send_Cmd(CMD17, sector * SD_BLK_SIZE) == 0) {
+        SPI_Timer_On(100);  // Wait for data packet (timeout of 100ms)
+        do {
+            tkn = SPI_RW(0xFF);
+#ifdef SD_IO_TRACE
+            wait++;
+#endif
+        } while((tkn==0xFF)&&(SPI_Timer_Status()==TRUE));
+        SPI_Timer_Off();
+#ifdef SD_IO_TRACE
+        __SD_Trace_Put(SD_TRC_READ, 0, 0, tkn, sector, wait);
+#endif
+        // Token of single block?
+        if(tkn==0xFE) {
+            // Hand over each chunk as soon as it was clocked in
+            for(ofs=0; ofs!=SD_BLK_SIZE; ofs+=SD_IO_STREAM_CHUNK)
+            {
+                for(idx=0; idx!=SD_IO_STREAM_CHUNK; idx++) chunk[idx] = SPI_RW(0xFF);
+                sink(ctx, chunk, SD_IO_STREAM_CHUNK);
+            }
+            // Skip CRC
+            SPI_RW(0xFF);
+            SPI_RW(0xFF);
+            res = SD_OK;
+        }
+    }
+    SPI_Release();
+#ifdef SD_IO_DBG_COUNT
+    dev->debug.read++;
+#endif
+    return(res);
+#endif
+}
+
+#ifdef SD_IO_WRITE
+SDRESULTS SD_WriteStream(SD_DEV *dev, DWORD sector, SD_SOURCE source, void *ctx)
+{
+    WORD ofs;
+#if defined(_M_IX86)
+    BYTE blk[SD_BLK_SIZE];
+#else
+    SDRESULTS res;
+    BYTE chunk[SD_IO_STREAM_CHUNK];
+    WORD idx;
+#ifdef SD_IO_WRITE_BYTES
+    BYTE slot;
+#endif
+#endif
+    if(sector > dev->last_sector) return(SD_PARERR);
+#if defined(_M_IX86)    // x86
+    // The host has memory to spare, only the callback interface matters.
+    // SD_Write also refreshes a buffered copy of the sector
+    for(ofs=0; ofs!=SD_BLK_SIZE; ofs+=SD_IO_STREAM_CHUNK)
+        source(ctx, blk + ofs, SD_IO_STREAM_CHUNK);
+    return(SD_Write(dev, blk, sector));
+#else   // uControllers
+    // Single block write (token <- 0xFE)
+    if(__SD_Send_Cmd(CMD24, sector * SD_BLK_SIZE)!=0) return(SD_ERROR);
+    SPI_RW(0xFE);
+    for(ofs=0; ofs!=SD_BLK_SIZE; ofs+=SD_IO_STREAM_CHUNK)
+    {
+        source(ctx, chunk, SD_IO_STREAM_CHUNK);
+        for(idx=0; idx!=SD_IO_STREAM_CHUNK; idx++) SPI_RW(chunk[idx]);
+    }
+    /* Dummy CRC */
+    SPI_RW(0xFF);
+    SPI_RW(0xFF);
+    res = __SD_Write_Wait(dev, 0xFE);
+#ifdef SD_IO_WRITE_BYTES
+    // The data isn't kept: a buffered copy is stale once the card has it
+    slot = __SD_WBuf_Find(dev, sector);
+    if((res == SD_OK) && (slot != SD_IO_WBUF_COUNT))
+    {
+        dev->wbuf[slot].valid = FALSE;
+        dev->wbuf[slot].dirty = FALSE;
+    }
+#endif
+    return(res);
 #endif
 }
 #endif
+#endif
+
+SDRESULTS SD_Sync(SD_DEV *dev)
+{
+#if defined(_M_IX86)    // x86
+    if(dev->fp == NULL) return(SD_ERROR);
+#ifdef SD_IO_WRITE_BYTES
+    if(SD_Flush(dev) != SD_OK) return(SD_ERROR);
+#endif
+    if(__SD_Sync_Buffers(dev) != SD_OK) return(SD_ERROR);
+    return(__SD_Sync_Files(dev));
+#else   // uControllers
+    BYTE line;
+#ifdef SD_IO_WRITE_BYTES
+    if(SD_Flush(dev) != SD_OK) return(SD_ERROR);
+#endif
+    // A write that timed out (SD_BUSY) may still be programming
+    __SD_Assert();
+    SPI_Timer_On(SD_IO_WRITE_TIMEOUT_WAIT);
+    do {
+        line = SPI_RW(0xFF);
+    } while((line!=0xFF)&&(SPI_Timer_Status()==TRUE));
+    SPI_Timer_Off();
+    if(line!=0xFF) return(SD_BUSY);
+    // Programming errors (protection, ECC, controller) are only in the status
+    return(SD_Health(dev, NULL));
+#endif
+}
 
 SDRESULTS SD_Status(SD_DEV *dev)
 {
+    // SEND_STATUS leaves the card as it is, unlike GO_IDLE_STATE
+    return(SD_Health(dev, NULL));
+}
+
+SDRESULTS SD_Health(SD_DEV *dev, WORD *r2)
+{
+#if defined(_M_IX86)
+    if(r2 != NULL) *r2 = 0;
+    return((dev->fp != NULL) ? SD_OK : SD_NOINIT);
+#else
+    BYTE r1, st;
+    if(r2 != NULL) *r2 = 0;
+#ifdef SD_IO_CARD_DETECT
+    if(SPI_Card_Present() == FALSE) {
+        dev->mount = FALSE;
+        return(SD_NOINIT);
+    }
+#endif
+    r1 = __SD_Send_Cmd(CMD13, 0);
+    st = SPI_RW(0xFF);
+    SPI_Release();
+    if(r1 & 0x80) return(SD_NORESPONSE);
+    if(r2 != NULL) *r2 = ((WORD)r1 << 8) | st;
+    // Back in idle state: it was reset or swapped, SD_Init is needed.
+    // SD_R1_* are placed in the high byte of «r2», «r1» is the raw R1
+    if(r1 & (SD_R1_IDLE >> 8)) {
+        dev->mount = FALSE;
+        return(SD_NOINIT);
+    }
+    return(((r1 & ~(SD_R1_IDLE >> 8)) || (st & ~SD_R2_LOCKED)) ? SD_ERROR : SD_OK);
+#endif
+}
+
+#if defined(SD_IO_TRACE) && !defined(_M_IX86)
+BOOL SD_Trace_Start(SD_TRACE *trc, SD_TRACE_EVT *evt, WORD size)
+{
+    // The full check and the indexes rely on «mask»
+    if((size == 0)||(size & (size - 1))) return(FALSE);
+    trc->evt = evt;
+    trc->mask = size - 1;
+    trc->head = 0;
+    trc->tail = 0;
+    trc->lost = 0;
+    __SD_Trace_Ring = trc;
+    return(TRUE);
+}
+
+void SD_Trace_Stop(void)
+{
+    __SD_Trace_Ring = NULL;
+}
+
+BOOL SD_Trace_Pop(SD_TRACE *trc, BYTE *rec)
+{
+    volatile SD_TRACE_EVT *evt;
+    if(trc->tail == trc->head) return(FALSE);
+    evt = &trc->evt[trc->tail & trc->mask];
+    rec[0] = evt->type;
+    rec[1] = evt->cmd;
+    rec[2] = evt->res;
+    rec[3] = evt->tkn;
+    rec[4] = (BYTE)(evt->arg >> 0 );
+    rec[5] = (BYTE)(evt->arg >> 8 );
+    rec[6] = (BYTE)(evt->arg >> 16);
+    rec[7] = (BYTE)(evt->arg >> 24);
+    rec[8] = (BYTE)(evt->wait >> 0 );
+    rec[9] = (BYTE)(evt->wait >> 8 );
+    rec[10] = (BYTE)(evt->wait >> 16);
+    rec[11] = (BYTE)(evt->wait >> 24);
+    // Release the slot only after it was copied
+    trc->tail++;
+    return(TRUE);
+}
+#endif
+
 #if defined(_M_IX86)
-    return((dev->fp == NULL) ? SD_OK : SD_NORESPONSE);
+SDRESULTS SD_Close(SD_DEV *dev)
+{
+    SDRESULTS res = SD_OK;
+#ifdef SD_IO_ASYNC
+    if((dev->aio != NULL)&&(SD_Async_Close(dev) != SD_OK)) res = SD_ERROR;
+#endif
+#ifdef SD_IO_WRITE_BYTES
+    if((dev->fp != NULL)&&(SD_Flush(dev) != SD_OK)) res = SD_ERROR;
+#endif
+#ifdef SD_IO_GROUP_COMMIT
+    if(dev->grp != NULL) {
+        pthread_mutex_destroy(&dev->grp->lock);
+        pthread_cond_destroy(&dev->grp->done);
+        free(dev->grp);
+        dev->grp = NULL;
+    }
+#endif
+#ifdef SD_IO_OVERLAY
+    if((dev->ofp != NULL)&&(fclose(dev->ofp) != 0)) res = SD_ERROR;
+    dev->ofp = NULL;
+    free(dev->map);
+    dev->map = NULL;
+#endif
+#ifdef SD_IO_SPARSE
+    free(dev->sp.map);
+    free(dev->sp.hot);
+    free(dev->sp.zbuf);
+    dev->sp.map = NULL;
+    dev->sp.hot = NULL;
+    dev->sp.zbuf = NULL;
+#endif
+    if((dev->fp != NULL)&&(fclose(dev->fp) != 0)) res = SD_ERROR;
+    dev->fp = NULL;
+    return(res);
+}
+
+#ifdef SD_IO_OVERLAY
+SDRESULTS SD_Overlay_Commit(SD_DEV *dev)
+{
+    BYTE buf[SD_BLK_SIZE];
+    DWORD sector;
+    SDRESULTS res = SD_OK;
+    if(dev->ofp == NULL) return(SD_PARERR);
+#ifdef SD_IO_WRITE_BYTES
+    if(SD_Flush(dev) != SD_OK) return(SD_ERROR);
+#endif
+    // The base is read-only while the overlay is in use
+    dev->fp = freopen(dev->fn, "r+b", dev->fp);
+    if(dev->fp == NULL) return(SD_ERROR);
+    for(sector=0; (sector<=dev->last_sector)&&(res == SD_OK); sector++)
+    {
+        if(!__SD_Overlay_Has(dev, sector)) continue;
+        res = __SD_File_Read(dev->ofp, __SD_Overlay_Pos(dev, sector), buf, SD_BLK_SIZE);
+        if(res == SD_OK) res = __SD_Image_Write(dev, sector, buf);
+    }
+    if(fflush(dev->fp) != 0) res = SD_ERROR;
+    // The delta is the only copy until the base is on the medium
+    if(res == SD_OK) res = __SD_Sync_File(dev->fp);
+    dev->fp = freopen(dev->fn, "rb", dev->fp);
+    if((dev->fp == NULL)||(res != SD_OK)) return(SD_ERROR);
+    // The base holds everything now, start over with an empty delta
+    return(__SD_Overlay_Create(dev));
+}
+
+SDRESULTS SD_Overlay_Discard(SD_DEV *dev)
+{
+    if(dev->ofp == NULL) return(SD_PARERR);
+#ifdef SD_IO_WRITE_BYTES
+    __SD_WBuf_Reset(dev);
+#endif
+    return(__SD_Overlay_Create(dev));
+}
+#endif
+
+#ifdef SD_IO_GROUP_COMMIT
+SDRESULTS SD_Group_Init(SD_DEV *dev, WORD count, DWORD usec)
+{
+    struct _SD_GROUP *grp;
+#if defined(_POSIX_CLOCK_SELECTION) && (_POSIX_CLOCK_SELECTION > 0)
+    pthread_condattr_t attr;
+#endif
+    if((dev->fp == NULL)||(count == 0)) return(SD_PARERR);
+    grp = dev->grp;
+    if(grp == NULL) {
+        grp = calloc(1, sizeof(struct _SD_GROUP));
+        if(grp == NULL) return(SD_ERROR);
+        pthread_mutex_init(&grp->lock, NULL);
+#if defined(_POSIX_CLOCK_SELECTION) && (_POSIX_CLOCK_SELECTION > 0)
+        // Deadlines are taken from SD_GROUP_CLOCK
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, SD_GROUP_CLOCK);
+        pthread_cond_init(&grp->done, &attr);
+        pthread_condattr_destroy(&attr);
 #else
-    return(__SD_Send_Cmd(CMD0, 0) ? SD_OK : SD_NORESPONSE);
+        // No clock selection (macOS): realtime deadlines, the default
+        pthread_cond_init(&grp->done, NULL);
+#endif
+        grp->res = SD_OK;
+        dev->grp = grp;
+    }
+    pthread_mutex_lock(&grp->lock);
+    grp->count = count;
+    grp->usec = usec;
+    // Waiters must see the new window
+    pthread_cond_broadcast(&grp->done);
+    pthread_mutex_unlock(&grp->lock);
+    return(SD_OK);
+}
+
+SDRESULTS SD_WriteDurable(SD_DEV *dev, void *dat, DWORD sector)
+{
+    struct _SD_GROUP *grp = dev->grp;
+    struct timespec now, end;
+    DWORD mine, upto;
+    SDRESULTS res;
+    if(grp == NULL) return(SD_NOINIT);
+    pthread_mutex_lock(&grp->lock);
+    // The lock also serializes the stdio stream between callers
+    res = SD_Write(dev, dat, sector);
+    if(res != SD_OK) {
+        pthread_mutex_unlock(&grp->lock);
+        return(res);
+    }
+    mine = ++grp->issued;
+    if(grp->pending++ == 0) clock_gettime(SD_GROUP_CLOCK, &grp->first);
+    while((grp->res == SD_OK)&&((LONG)(grp->durable - mine) < 0)) {
+        // End of the window of the oldest pending write. Each field stays
+        // below 2^31, so a 32-bit long is enough
+        end.tv_sec = grp->first.tv_sec + grp->usec / 1000000;
+        end.tv_nsec = grp->first.tv_nsec + (long)(grp->usec % 1000000) * 1000L;
+        if(end.tv_nsec >= 1000000000L) {
+            end.tv_sec++;
+            end.tv_nsec -= 1000000000L;
+        }
+        clock_gettime(SD_GROUP_CLOCK, &now);
+        if(!grp->syncing && grp->pending
+            && ((grp->pending >= grp->count)||(now.tv_sec > end.tv_sec)
+                ||((now.tv_sec == end.tv_sec)&&(now.tv_nsec >= end.tv_nsec)))) {
+            // Close the batch: this caller syncs it for everybody
+            grp->syncing = TRUE;
+            upto = grp->issued;
+            grp->pending = 0;
+            res = __SD_Sync_Buffers(dev);
+            pthread_mutex_unlock(&grp->lock);
+            if(res == SD_OK) res = __SD_Sync_Files(dev);
+            pthread_mutex_lock(&grp->lock);
+            if(res != SD_OK) grp->res = res;
+            grp->durable = upto;
+            grp->syncing = FALSE;
+            pthread_cond_broadcast(&grp->done);
+            continue;
+        }
+        if(grp->syncing || !grp->pending) {
+            pthread_cond_wait(&grp->done, &grp->lock);
+        } else {
+            // Sleep until the window of the oldest pending write closes
+            pthread_cond_timedwait(&grp->done, &grp->lock, &end);
+        }
+    }
+    res = grp->res;
+    pthread_mutex_unlock(&grp->lock);
+    return(res);
+}
+#endif
+
+#ifdef SD_IO_ASYNC
+SDRESULTS SD_Async_Init(SD_DEV *dev, WORD depth, BYTE flags)
+{
+    struct _SD_ASYNC *aio;
+    WORD idx;
+    BOOL sync = FALSE;
+    if((dev->fp == NULL)||(depth == 0)) return(SD_PARERR);
+    if(dev->aio != NULL) return(SD_PARERR);
+#ifdef SD_IO_WRITE_BYTES
+    if(SD_Flush(dev) != SD_OK) return(SD_ERROR);
+#endif
+    // Pending stdio data must reach the file before another descriptor reads it
+    if(fflush(dev->fp) != 0) return(SD_ERROR);
+#ifdef SD_IO_OVERLAY
+    if(dev->ofp != NULL) sync = TRUE;
+#endif
+#ifdef SD_IO_SPARSE
+    if(dev->sp.map != NULL) sync = TRUE;
+#endif
+    aio = calloc(1, sizeof(struct _SD_ASYNC));
+    if(aio == NULL) return(SD_ERROR);
+    dev->aio = aio;
+    aio->fd = -1;
+#ifdef __linux__
+    aio->ring = -1;
+#endif
+    aio->flags = flags;
+    aio->depth = depth;
+    aio->req = calloc(depth, sizeof(SD_AREQ));
+    aio->slot = calloc(depth, sizeof(WORD));
+    aio->ready = calloc(depth, sizeof(WORD));
+    aio->queue = calloc(depth, sizeof(WORD));
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->work, NULL);
+    pthread_cond_init(&aio->done, NULL);
+    if((aio->req == NULL)||(aio->slot == NULL)||(aio->ready == NULL)||(aio->queue == NULL))
+    {
+        SD_Async_Close(dev);
+        return(SD_ERROR);
+    }
+    for(idx=0; idx!=depth; idx++) aio->slot[idx] = depth - 1 - idx;
+    aio->nfree = depth;
+    // Overlays and sparse images map sectors in user space: run in place
+    if(sync) return(SD_OK);
+    if(flags & SD_ASYNC_DIRECT) {
+        if(posix_memalign((void **)&aio->bufs, 4096, (size_t)depth * 4096) != 0) {
+            aio->bufs = NULL;
+            SD_Async_Close(dev);
+            return(SD_ERROR);
+        }
+        for(idx=0; idx!=depth; idx++) aio->req[idx].buf = aio->bufs + (size_t)idx * 4096;
+    }
+    aio->fd = open(dev->fn, O_RDWR
+#ifdef O_DIRECT
+        | ((flags & SD_ASYNC_DIRECT) ? O_DIRECT : 0)
+#endif
+        );
+    if(aio->fd < 0) {
+        SD_Async_Close(dev);
+        return(SD_ERROR);
+    }
+#ifdef __linux__
+    if(__SD_Uring_Open(aio) == SD_OK) return(SD_OK);
+    // No io_uring here (old kernel, seccomp...): fall back to threads
+    if(aio->ring >= 0) close(aio->ring);
+    if(aio->sq_ptr && (aio->sq_ptr != MAP_FAILED)) munmap(aio->sq_ptr, aio->sq_len);
+    if(aio->cq_ptr && (aio->cq_ptr != MAP_FAILED)) munmap(aio->cq_ptr, aio->cq_len);
+    if(aio->sqes && ((void *)aio->sqes != MAP_FAILED)) munmap(aio->sqes, aio->sqe_len);
+    aio->ring = -1;
+#endif
+    aio->nthr = (depth < SD_IO_ASYNC_THREADS) ? depth : SD_IO_ASYNC_THREADS;
+    aio->thr = calloc(aio->nthr, sizeof(pthread_t));
+    if(aio->thr == NULL) {
+        aio->nthr = 0;
+        SD_Async_Close(dev);
+        return(SD_ERROR);
+    }
+    for(idx=0; idx!=aio->nthr; idx++) {
+        if(pthread_create(&aio->thr[idx], NULL, __SD_Async_Worker, aio) != 0) {
+            aio->nthr = idx;
+            SD_Async_Close(dev);
+            return(SD_ERROR);
+        }
+    }
+    return(SD_OK);
+}
+
+SDRESULTS SD_SubmitRead(SD_DEV *dev, void *dat, DWORD sector, void *tag)
+{
+    return(__SD_Async_Submit(dev, dat, sector, tag, FALSE));
+}
+
+SDRESULTS SD_SubmitWrite(SD_DEV *dev, void *dat, DWORD sector, void *tag)
+{
+    return(__SD_Async_Submit(dev, dat, sector, tag, TRUE));
+}
+
+WORD SD_Reap(SD_DEV *dev, SD_CQE *cqe, WORD max, BOOL wait)
+{
+    struct _SD_ASYNC *aio = dev->aio;
+    SD_AREQ *rq;
+    WORD n, id;
+    BOOL wrote = FALSE;
+#ifdef __linux__
+    SDRESULTS res;
+#endif
+    if((aio == NULL)||(max == 0)) return(0);
+    pthread_mutex_lock(&aio->lock);
+    // Nothing ready and nothing in flight: don't wait forever
+    if(aio->rcnt == 0 && aio->nfree == aio->depth) wait = FALSE;
+#ifdef __linux__
+    if(aio->ring >= 0) {
+        // The lock is dropped while waiting, another reaper may take it all.
+        // A failed ring stops the wait, the caller gets what is ready
+        res = __SD_Uring_Enter(aio, (wait && (aio->rcnt == 0)) ? TRUE : FALSE);
+        while((res == SD_OK) && wait && (aio->rcnt == 0) && (aio->nfree != aio->depth))
+            res = __SD_Uring_Enter(aio, TRUE);
+    }
+    else
+#endif
+    while(wait && (aio->rcnt == 0) && (aio->nfree != aio->depth))
+        pthread_cond_wait(&aio->done, &aio->lock);
+    for(n=0; (n!=max)&&(aio->rcnt!=0); n++) {
+        id = aio->ready[aio->rhead];
+        aio->rhead = (aio->rhead + 1) % aio->depth;
+        aio->rcnt--;
+        rq = &aio->req[id];
+        cqe[n].tag = rq->tag;
+        cqe[n].res = rq->res;
+#ifdef SD_IO_DBG_COUNT
+        // In synchronous mode SD_Read/SD_Write have counted it already
+        if((aio->fd >= 0)&&(rq->res == SD_OK)) {
+            if(rq->write) dev->debug.write++;
+            else dev->debug.read++;
+        }
 #endif
+        if(rq->write && (aio->fd >= 0)) wrote = TRUE;
+        aio->slot[aio->nfree++] = id;
+    }
+    pthread_mutex_unlock(&aio->lock);
+    // The stdio read buffer may hold what those writes replaced. A seek can
+    // be served from it, so flush and move outside it to drop it
+    if(wrote) {
+        fflush(dev->fp);
+        fseek(dev->fp, 0, SEEK_END);
+    }
+    return(n);
+}
+
+SDRESULTS SD_Async_Close(SD_DEV *dev)
+{
+    struct _SD_ASYNC *aio = dev->aio;
+    SD_CQE cqe[1];
+    WORD idx;
+    if(aio == NULL) return(SD_PARERR);
+    // Drain: requests in flight still point to the caller's buffers. If the
+    // ring failed, closing it below cancels and waits for what is left
+    if(aio->req && aio->slot && aio->ready)
+        while(aio->nfree != aio->depth)
+            if(SD_Reap(dev, cqe, 1, TRUE) == 0) break;
+    pthread_mutex_lock(&aio->lock);
+    aio->stop = TRUE;
+    pthread_cond_broadcast(&aio->work);
+    pthread_mutex_unlock(&aio->lock);
+    for(idx=0; idx!=aio->nthr; idx++) pthread_join(aio->thr[idx], NULL);
+#ifdef __linux__
+    if(aio->ring >= 0) {
+        munmap(aio->sq_ptr, aio->sq_len);
+        munmap(aio->cq_ptr, aio->cq_len);
+        munmap(aio->sqes, aio->sqe_len);
+        close(aio->ring);
+    }
+#endif
+    if(aio->fd >= 0) close(aio->fd);
+    pthread_mutex_destroy(&aio->lock);
+    pthread_cond_destroy(&aio->work);
+    pthread_cond_destroy(&aio->done);
+    free(aio->thr);
+    free(aio->bufs);
+    free(aio->req);
+    free(aio->slot);
+    free(aio->ready);
+    free(aio->queue);
+    free(aio);
+    dev->aio = NULL;
+    return(SD_OK);
+}
+#endif
+
+#ifdef SD_IO_SPARSE
+SDRESULTS SD_Image_Create(const char *fn, DWORD sectors)
+{
+    SD_SPARSE sp;
+    BYTE *map;
+    FILE *fp;
+    SDRESULTS res;
+    if(sectors == 0) return(SD_PARERR);
+    sp.sectors = sectors;
+    sp.chunk = SD_IO_SPARSE_CHUNK;
+    sp.chunks = (sectors + sp.chunk - 1) / sp.chunk;
+    sp.mapsec = (sp.chunks * 8 + SD_BLK_SIZE - 1) / SD_BLK_SIZE;
+    map = calloc(sp.mapsec, SD_BLK_SIZE);
+    if(map == NULL) return(SD_ERROR);
+    fp = fopen(fn, "wb");
+    if(fp == NULL) res = SD_ERROR;
+    else {
+        res = __SD_Sparse_Format(fp, &sp, map);
+        if(fclose(fp) != 0) res = SD_ERROR;
+    }
+    free(map);
+    return(res);
+}
+
+SDRESULTS SD_Image_Pack(SD_DEV *dev)
+{
+    char tmp[sizeof(dev->fn) + 4];
+    BYTE *map, *raw, *pk;
+    FILE *fp;
+    DWORD chunk, loc, len, n, pos;
+    SDRESULTS res = SD_OK;
+    if((dev->fp == NULL)||(dev->sp.map == NULL)) return(SD_PARERR);
+#ifdef SD_IO_OVERLAY
+    // A base shared by overlays must not change under them
+    if(dev->ofp != NULL) return(SD_PARERR);
+#endif
+#ifdef SD_IO_WRITE_BYTES
+    if(SD_Flush(dev) != SD_OK) return(SD_ERROR);
+#endif
+    strcpy(tmp, dev->fn);
+    strcat(tmp, ".tmp");
+    n = dev->sp.chunk * SD_BLK_SIZE;
+    map = calloc(dev->sp.mapsec, SD_BLK_SIZE);
+    raw = malloc(n);
+    pk = malloc(n);
+    fp = fopen(tmp, "w+b");
+    if((map == NULL)||(raw == NULL)||(pk == NULL)||(fp == NULL)) res = SD_ERROR;
+    pos = 1 + dev->sp.mapsec;
+    for(chunk=0; (chunk!=dev->sp.chunks)&&(res == SD_OK); chunk++)
+    {
+        loc = __SD_Ld_Dword(dev->sp.map + chunk * 8);
+        len = __SD_Ld_Dword(dev->sp.map + chunk * 8 + 4);
+        if(loc == 0) continue;
+        if(len == 0) res = __SD_File_Read(dev->fp, (long)loc * SD_BLK_SIZE, raw, n);
+        else if((res = __SD_Sparse_Load(dev, chunk)) == SD_OK) memcpy(raw, dev->sp.zbuf, n);
+        if((res != SD_OK)||__SD_Is_Zero(raw, n)) continue;
+        // Cold chunks (not written since open or the last pack) get compressed
+        len = 0;
+        if(!(dev->sp.hot[chunk >> 3] & (1 << (chunk & 7))))
+            len = __SD_LZ_Pack(raw, n, pk, n - SD_BLK_SIZE);
+        if(len) res = __SD_File_Write(fp, (long)pos * SD_BLK_SIZE, pk, len);
+        else res = __SD_File_Write(fp, (long)pos * SD_BLK_SIZE, raw, n);
+        __SD_St_Dword(map + chunk * 8, pos);
+        __SD_St_Dword(map + chunk * 8 + 4, len);
+        pos += len ? (len + SD_BLK_SIZE - 1) / SD_BLK_SIZE : dev->sp.chunk;
+    }
+    if(res == SD_OK) res = __SD_Sparse_Format(fp, &dev->sp, map);
+    if((fp != NULL)&&(fclose(fp) != 0)) res = SD_ERROR;
+    free(raw);
+    free(pk);
+    if(res != SD_OK)
+    {
+        free(map);
+        remove(tmp);
+        return(res);
+    }
+    // Swap the files and keep working on the packed one
+    fclose(dev->fp);
+    dev->fp = NULL;
+    if((rename(tmp, dev->fn) != 0)||((dev->fp = fopen(dev->fn, "r+b")) == NULL))
+    {
+        free(map);
+        return(SD_ERROR);
+    }
+    free(dev->sp.map);
+    dev->sp.map = map;
+    memset(dev->sp.hot, 0, (dev->sp.chunks + 7) / 8);
+    dev->sp.zchunk = dev->sp.chunks;
+    dev->sp.next = pos;
+    return(SD_OK);
 }
+#endif
+#endif
 
 // «sd_io.c» is part of:
 /*----------------------------------------------------------------------------/
@@ -17,22 +17,120 @@
 //#define SD_IO_WRITE_WAIT_BLOCKER
 #define SD_IO_WRITE_TIMEOUT_WAIT 250
 
+//#define SD_IO_OVERLAY      // x86: read-only base image plus a delta file
+//#define SD_IO_SPARSE       // x86: sparse, zero-deduplicated image format
+//#define SD_IO_GROUP_COMMIT // x86: durable writes acknowledged in batches
+//#define SD_IO_ASYNC        // x86: asynchronous engine (io_uring or threads)
+#define SD_IO_ASYNC_THREADS 4 // Threads of the pool when io_uring is missing
+#define SD_IO_SPARSE_CHUNK 64 // Sectors per chunk of new sparse images, 1..128
+//#define SD_IO_WRITE_BYTES  // Byte-range writes through a coalescing buffer
+#define SD_IO_WBUF_COUNT 1  // Sectors held by the coalescing buffer
+
+//#define SD_IO_TRACE        // uC: record SPI transactions in a ring buffer
+//#define SD_IO_CARD_DETECT  // uC: SD_Health asks SPI_Card_Present first
+//#define SD_IO_STREAM       // Block transfer through callbacks, no sector buffer
+#define SD_IO_STREAM_CHUNK 16 // Bytes per callback, must divide 512
+
 //#define SD_IO_DBG_COUNT
 /*****************************************************************************/
 
+#include "integer.h"
+
+#define SD_BLK_SIZE     512
+
+#if defined(SD_IO_WRITE_BYTES) && !defined(SD_IO_WRITE)
+#error "SD_IO_WRITE_BYTES requires SD_IO_WRITE"
+#endif
+
+/* Bits of the R2 response given by SD_Health: R1 (high byte) */
+#define SD_R1_IDLE          0x0100  /* In idle state, needs SD_Init */
+#define SD_R1_ERASE_RESET   0x0200  /* Erase sequence was cleared   */
+#define SD_R1_ILLEGAL_CMD   0x0400  /* Illegal command              */
+#define SD_R1_CRC_ERR       0x0800  /* Command CRC error            */
+#define SD_R1_ERASE_SEQ     0x1000  /* Erase sequence error         */
+#define SD_R1_ADDRESS_ERR   0x2000  /* Misaligned address           */
+#define SD_R1_PARAM_ERR     0x4000  /* Argument out of range        */
+/* Bits of the R2 response given by SD_Health: card status (low byte) */
+#define SD_R2_LOCKED        0x0001  /* Card is locked               */
+#define SD_R2_LOCK_FAILED   0x0002  /* WP erase skip or lock failed */
+#define SD_R2_ERROR         0x0004  /* General or unknown error     */
+#define SD_R2_CC_ERR        0x0008  /* Internal card controller err */
+#define SD_R2_ECC_FAILED    0x0010  /* Card ECC failed              */
+#define SD_R2_WP_VIOLATION  0x0020  /* Write to a protected block   */
+#define SD_R2_ERASE_PARAM   0x0040  /* Invalid erase selection      */
+#define SD_R2_OUT_OF_RANGE  0x0080  /* Out of range or CSD overwrite*/
+
+#ifdef SD_IO_WRITE_BYTES
+/* Counters of the coalescing write buffer */
+typedef struct _WB_COUNT {
+    DWORD patches;      /* Byte-range updates accepted          */
+    DWORD programs;     /* Sectors programmed on evict or flush */
+    DWORD saved;        /* Updates absorbed by a dirty sector   */
+} WB_COUNT;
+
+/* Slot of the coalescing write buffer */
+typedef struct _SD_WBUF {
+    DWORD sector;
+    BOOL valid;
+    BOOL dirty;
+    WORD stamp;         /* Last use, for LRU eviction */
+    BYTE data[SD_BLK_SIZE];
+} SD_WBUF;
+#endif
+
+#if defined(SD_IO_STREAM) && (SD_BLK_SIZE % SD_IO_STREAM_CHUNK)
+#error "SD_IO_STREAM_CHUNK must divide SD_BLK_SIZE"
+#endif
+
+#ifdef SD_IO_STREAM
+/* Receives each chunk of a block being read */
+typedef void (*SD_SINK)(void *ctx, const BYTE *dat, WORD cnt);
+/* Fills each chunk of a block being written */
+typedef void (*SD_SOURCE)(void *ctx, BYTE *dat, WORD cnt);
+#endif
+
+#ifdef SD_IO_TRACE
+/* Types of trace events */
+#define SD_TRC_CMD      0x01    /* Command: R1 response, polls until it    */
+#define SD_TRC_READ     0x02    /* Read data: token, polls until it        */
+#define SD_TRC_WRITE    0x03    /* Write data: data response, busy polls   */
+
+/* Size of a serialized event: type, cmd, res, tkn, arg[4], wait[4] (LE) */
+#define SD_TRC_REC_SIZE 12
+
+/* Trace event. Waits count SPI_RW polls, 8 SPI clocks each */
+typedef struct _SD_TRACE_EVT {
+    BYTE type;      /* SD_TRC_*                                 */
+    BYTE cmd;       /* Command index (CMD0..CMD63)              */
+    BYTE res;       /* R1 response or data response             */
+    BYTE tkn;       /* Data token received or sent              */
+    DWORD arg;      /* Command argument or sector               */
+    DWORD wait;     /* Polls until response, token or not busy  */
+} SD_TRACE_EVT;
+
+/* Single producer, single consumer ring of trace events */
+typedef struct _SD_TRACE {
+    volatile SD_TRACE_EVT *evt; /* Caller-provided storage      */
+    WORD mask;              /* Entries - 1, entries are 2^n     */
+    volatile WORD head;     /* Written only by the driver       */
+    volatile WORD tail;     /* Written only by the consumer     */
+    volatile WORD lost;     /* Events dropped on a full ring    */
+} SD_TRACE;
+#endif
+
 #if defined(_M_IX86)
 
 #include <stdio.h>
-#include "integer.h"
 
 /* Results of SD functions */
 typedef enum {
     SD_OK = 0,      /* 0: Function succeeded    */
-    SD_NOINIT       /* 1: SD not initialized    */
+    SD_NOINIT,      /* 1: SD not initialized    */
     SD_ERROR,       /* 2: Disk error            */
     SD_PARERR,      /* 3: Invalid parameter     */
     SD_BUSY,        /* 4: Programming busy      */
-    SD_REJECT       /* 5: Reject data           */
+    SD_REJECT,      /* 5: Reject data           */
+    SD_NORESPONSE   /* 6: No response           */
 } SDRESULTS;
 
 #ifdef SD_IO_DBG_COUNT
@@ -42,6 +140,38 @@ typedef struct _DBG_COUNT {
 } DBG_COUNT;
 #endif
 
+#ifdef SD_IO_SPARSE
+/* State of a sparse image */
+typedef struct _SD_SPARSE {
+    BYTE *map;      /* Chunk map as stored in the file, NULL for raw images */
+    BYTE *hot;      /* One bit per chunk written since open or last pack    */
+    BYTE *zbuf;     /* Last decompressed chunk                              */
+    DWORD zchunk;   /* Chunk held by «zbuf», «chunks» if none               */
+    DWORD sectors;  /* Virtual capacity                                     */
+    DWORD chunk;    /* Sectors per chunk                                    */
+    DWORD chunks;   /* Entries of the chunk map                             */
+    DWORD mapsec;   /* Sectors used by the chunk map in the file            */
+    DWORD next;     /* First free sector at the end of the file             */
+} SD_SPARSE;
+#endif
+
+#ifdef SD_IO_GROUP_COMMIT
+struct _SD_GROUP;       /* Private to sd_io.c */
+#endif
+
+#ifdef SD_IO_ASYNC
+/* Flags of SD_Async_Init */
+#define SD_ASYNC_DIRECT 0x01    /* O_DIRECT through aligned, registered buffers */
+
+/* Completion given by SD_Reap */
+typedef struct _SD_CQE {
+    void *tag;          /* As passed to SD_Submit«Read|Write» */
+    SDRESULTS res;
+} SD_CQE;
+
+struct _SD_ASYNC;       /* Private to sd_io.c */
+#endif
+
 /* SD device object */
 typedef struct _SD_DEV {
     BOOL mount;
@@ -49,6 +179,26 @@ typedef struct _SD_DEV {
     char fn[20]; /* dd if=/dev/zero of=sim_sd.raw bs=1k count=0 seek=8192 */
     FILE *fp;
     DWORD last_sector;
+#ifdef SD_IO_OVERLAY
+    char ovl[20]; /* Delta file. Empty string writes straight to «fn» */
+    FILE *ofp;
+    BYTE *map;    /* One bit per sector, set if it lives in the delta */
+    DWORD mapsec; /* Sectors used by the map in the delta file */
+#endif
+#ifdef SD_IO_SPARSE
+    SD_SPARSE sp;
+#endif
+#ifdef SD_IO_ASYNC
+    struct _SD_ASYNC *aio;
+#endif
+#ifdef SD_IO_GROUP_COMMIT
+    struct _SD_GROUP *grp;
+#endif
+#ifdef SD_IO_WRITE_BYTES
+    SD_WBUF wbuf[SD_IO_WBUF_COUNT];
+    WORD wbtick;
+    WB_COUNT wbcount;
+#endif
 #ifdef SD_IO_DBG_COUNT
     DBG_COUNT debug;
 #endif
@@ -64,6 +214,7 @@ typedef struct _SD_DEV {
 #define ACMD41  (0xC0+41)       /* SEND_OP_COND (SDC)       */
 #define CMD8    (0x40+8)        /* SEND_IF_COND             */
 #define CMD9    (0x40+9)        /* SEND_CSD                 */
+#define CMD13   (0x40+13)       /* SEND_STATUS              */
 #define CMD16   (0x40+16)       /* SET_BLOCKLEN             */
 #define CMD17   (0x40+17)       /* READ_SINGLE_BLOCK        */
 #define CMD24   (0x40+24)       /* WRITE_SINGLE_BLOCK       */
@@ -81,8 +232,6 @@ typedef struct _SD_DEV {
 #define SDCT_SDC        (SDCT_SD1|SDCT_SD2)     /* SD               */
 #define SDCT_BLOCK      0x08                    /* Block addressing */
 
-#define SD_BLK_SIZE     512
-
 /* Results of SD functions */
 typedef enum {
     SD_OK = 0,      /* 0: Function succeeded    */
@@ -107,6 +256,11 @@ typedef struct _SD_DEV {
     BOOL mount;
     BYTE cardtype;
     DWORD last_sector;
+#ifdef SD_IO_WRITE_BYTES
+    SD_WBUF wbuf[SD_IO_WBUF_COUNT];
+    WORD wbtick;
+    WB_COUNT wbcount;
+#endif
 #ifdef SD_IO_DBG_COUNT
     DBG_COUNT debug;
 #endif
@@ -142,12 +296,203 @@ SDRESULTS SD_Read (SD_DEV *dev, void *dat, DWORD sector, WORD ofs, WORD cnt);
  */
 SDRESULTS SD_Write (SD_DEV *dev, void *dat, DWORD sector);
 
+#ifdef SD_IO_WRITE_BYTES
+/**
+    \brief Write a byte range inside a sector through the coalescing buffer.
+    The sector is programmed later, when its slot is evicted or on SD_Flush.
+    \param dat Data to write.
+    \param sector Sector number to patch.
+    \param ofs Byte offset in the sector (0..511).
+    \param cnt Byte count (1..512).
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_WriteBytes (SD_DEV *dev, void *dat, DWORD sector, WORD ofs, WORD cnt);
+
+/**
+    \brief Program every dirty sector held by the coalescing buffer.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Flush (SD_DEV *dev);
+#endif
+
+#ifdef SD_IO_STREAM
+/**
+    \brief Read a whole block handing it to «sink» in chunks of
+    SD_IO_STREAM_CHUNK bytes, while it is being clocked in.
+    \param sector Sector number to read.
+    \param sink Called once per chunk, in order.
+    \param ctx Passed to «sink».
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_ReadStream (SD_DEV *dev, DWORD sector, SD_SINK sink, void *ctx);
+
 /**
-    \brief Allows know status of SD card.
+    \brief Write a whole block asking «source» for it in chunks of
+    SD_IO_STREAM_CHUNK bytes, while it is being clocked out.
+    \param sector Sector number to write.
+    \param source Called once per chunk, in order.
+    \param ctx Passed to «source».
     \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_WriteStream (SD_DEV *dev, DWORD sector, SD_SOURCE source, void *ctx);
+#endif
+
+/**
+    \brief Make every write done so far durable. Flushes the byte-range
+    buffer, then on x86 the stdio buffers and fdatasync. On a card it waits
+    for the end of programming and checks the status for write errors.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Sync (SD_DEV *dev);
+
+/**
+    \brief Allows know status of SD card. It doesn't reset the card.
+    \return Same as SD_Health: SD_OK, SD_ERROR, SD_NOINIT (SD_Init is
+    needed) or SD_NORESPONSE.
 */
 SDRESULTS SD_Status (SD_DEV *dev);
 
+/**
+    \brief Ask the card its status (SEND_STATUS), a few bytes on the bus.
+    \param r2 Where to put the R2 response (SD_R1_* and SD_R2_* bits), or NULL.
+    \return SD_OK if healthy, SD_ERROR if any error bit is set, SD_NOINIT
+    if the card is missing or went back to idle state, SD_NORESPONSE if it
+    doesn't answer.
+*/
+SDRESULTS SD_Health (SD_DEV *dev, WORD *r2);
+
+#if defined(SD_IO_TRACE) && !defined(_M_IX86)
+/**
+    \brief Start recording SPI transactions.
+    \param trc Ring descriptor.
+    \param evt Storage for the events.
+    \param size Number of events in «evt», must be a power of two.
+    \return FALSE if «size» isn't a power of two, nothing is recorded then.
+ */
+BOOL SD_Trace_Start (SD_TRACE *trc, SD_TRACE_EVT *evt, WORD size);
+
+/**
+    \brief Stop recording. Events already in the ring can still be popped.
+ */
+void SD_Trace_Stop (void);
+
+/**
+    \brief Take the oldest event out of the ring, serialized.
+    \param trc Ring descriptor.
+    \param rec Destination of SD_TRC_REC_SIZE bytes.
+    \return FALSE if the ring is empty.
+ */
+BOOL SD_Trace_Pop (SD_TRACE *trc, BYTE *rec);
+#endif
+
+#if defined(_M_IX86)
+/**
+    \brief Close the image files and release their resources.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Close (SD_DEV *dev);
+
+#ifdef SD_IO_OVERLAY
+/**
+    \brief Copy every sector of the delta file into the base image and
+    start over with an empty delta.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Overlay_Commit (SD_DEV *dev);
+
+/**
+    \brief Drop every sector of the delta file. The base image is untouched.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Overlay_Discard (SD_DEV *dev);
+#endif
+
+#ifdef SD_IO_GROUP_COMMIT
+/**
+    \brief Set the batching window of SD_WriteDurable. Can be called
+    again to change it.
+    \param count A batch is synced once it holds this many writes...
+    \param usec ...or once its oldest write is this old (microseconds).
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Group_Init (SD_DEV *dev, WORD count, DWORD usec);
+
+/**
+    \brief Write a sector and return once it is durable. Concurrent callers
+    share a single fdatasync per batch. Thread-safe among its own callers.
+    \param dat Data to write.
+    \param sector Sector number to write.
+    \return SD_OK once durable. A failed sync is reported from then on.
+ */
+SDRESULTS SD_WriteDurable (SD_DEV *dev, void *dat, DWORD sector);
+#endif
+
+#ifdef SD_IO_ASYNC
+/**
+    \brief Start the asynchronous engine: io_uring when the kernel allows
+    it, a pool of SD_IO_ASYNC_THREADS threads otherwise. Overlays and sparse
+    images are served in place, at submission time.
+    \param depth Maximum number of requests in flight.
+    \param flags SD_ASYNC_DIRECT or zero.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Async_Init (SD_DEV *dev, WORD depth, BYTE flags);
+
+/**
+    \brief Queue the read of a whole sector. With io_uring, queued requests
+    reach the kernel on the next SD_Reap, in a single system call.
+    \param dat Destination, SD_BLK_SIZE bytes, untouched until reaped.
+    \param sector Sector number.
+    \param tag Given back by SD_Reap.
+    \return SD_OK, SD_BUSY if «depth» requests are in flight.
+ */
+SDRESULTS SD_SubmitRead (SD_DEV *dev, void *dat, DWORD sector, void *tag);
+
+/**
+    \brief Queue the write of a whole sector.
+    \param dat Source, SD_BLK_SIZE bytes, untouched until reaped.
+    \param sector Sector number.
+    \param tag Given back by SD_Reap.
+    \return SD_OK, SD_BUSY if «depth» requests are in flight.
+ */
+SDRESULTS SD_SubmitWrite (SD_DEV *dev, void *dat, DWORD sector, void *tag);
+
+/**
+    \brief Collect finished requests.
+    \param cqe Destination of the completions.
+    \param max Size of «cqe».
+    \param wait TRUE to block until one completes, if any is in flight.
+    \return Number of completions stored in «cqe». Zero while waiting with
+    requests in flight means io_uring failed: SD_Submit* then return
+    SD_ERROR and SD_Async_Close ends the engine.
+ */
+WORD SD_Reap (SD_DEV *dev, SD_CQE *cqe, WORD max, BOOL wait);
+
+/**
+    \brief Wait for every request in flight and stop the engine.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Async_Close (SD_DEV *dev);
+#endif
+
+#ifdef SD_IO_SPARSE
+/**
+    \brief Create an empty sparse image. SD_Init recognizes it by its header.
+    \param fn File name.
+    \param sectors Virtual capacity in sectors.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Image_Create (const char *fn, DWORD sectors);
+
+/**
+    \brief Rewrite a sparse image without dead space. Chunks not written
+    since SD_Init or the last pack are compressed.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Image_Pack (SD_DEV *dev);
+#endif
+#endif
+
 #endif
 
 // «sd_io.h» is part of:
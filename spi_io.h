@@ -69,6 +69,12 @@ BOOL SPI_Timer_Status (void);
  */
 void SPI_Timer_Off (void);
 
+/**
+    \brief Read the card detect switch. Only needed with SD_IO_CARD_DETECT.
+    \return TRUE if a card is in the socket.
+ */
+BOOL SPI_Card_Present (void);
+
 #endif
 
 /*
@@ -0,0 +1,203 @@
+/*
+ *  File: sdtrace.c
+ *  License at the end of file.
+ *
+ *  Decode a trace recorded with SD_IO_TRACE, report the time spent in each
+ *  phase and optionally replay it against an image with the x86 emulation.
+ *
+ *  Build (GNU/Linux):
+ *      gcc -D_M_IX86 -I.. -o sdtrace sdtrace.c ../sd_io.c
+ *
+ *  Use:
+ *      sdtrace [-d] [-k kHz] trace.bin [image]
+ *
+ *  «trace.bin» is the concatenation of the records given by SD_Trace_Pop.
+ *  Waits are counted in SPI_RW polls (8 SPI clocks each), «-k» sets the SPI
+ *  clock used to convert them to microseconds (default 12000 kHz). «-d»
+ *  prints every event.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+#define SD_IO_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sd_io.h"
+
+/* Phases of the breakdown */
+enum {
+    PH_CMD = 0,     /* Command sent until R1 response       */
+    PH_TOKEN,       /* CMD17 accepted until data token      */
+    PH_BUSY,        /* Data accepted until card not busy    */
+    PH_HOST_READ,   /* Replay: SD_Read on the image         */
+    PH_HOST_WRITE,  /* Replay: SD_Write on the image        */
+    PH_COUNT
+};
+
+static const char *ph_name[PH_COUNT] = {
+    "cmd response", "read token", "write busy", "replay read", "replay write"
+};
+
+typedef struct {
+    unsigned long n;
+    double sum, min, max;   /* Microseconds */
+} STAT;
+
+static STAT stat[PH_COUNT];
+static STAT cmd_stat[64];
+
+static void stat_add (STAT *st, double us)
+{
+    if(st->n == 0 || us < st->min) st->min = us;
+    if(st->n == 0 || us > st->max) st->max = us;
+    st->sum += us;
+    st->n++;
+}
+
+static void stat_print (const char *name, const STAT *st)
+{
+    if(st->n == 0) return;
+    printf("  %-14s %8lu %12.1f %12.1f %12.1f\n", name, st->n,
+        st->min, st->sum / st->n, st->max);
+}
+
+static double now_us (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+static void decode (const BYTE *rec, SD_TRACE_EVT *evt)
+{
+    evt->type = rec[0];
+    evt->cmd = rec[1];
+    evt->res = rec[2];
+    evt->tkn = rec[3];
+    evt->arg = rec[4] | ((DWORD)rec[5] << 8) | ((DWORD)rec[6] << 16) | ((DWORD)rec[7] << 24);
+    evt->wait = rec[8] | ((DWORD)rec[9] << 8) | ((DWORD)rec[10] << 16) | ((DWORD)rec[11] << 24);
+}
+
+int main (int argc, char *argv[])
+{
+    BYTE rec[SD_TRC_REC_SIZE], blk[SD_BLK_SIZE];
+    SD_TRACE_EVT evt;
+    SD_DEV dev[1];
+    FILE *fp;
+    double khz = 12000, us, t0;
+    DWORD wsector = 0;
+    BOOL dump = FALSE, replay = FALSE;
+    unsigned long events = 0, errors = 0, range = 0;
+    int idx;
+
+    for(idx = 1; idx < argc && argv[idx][0] == '-'; idx++) {
+        if(strcmp(argv[idx], "-d") == 0) dump = TRUE;
+        else if(strcmp(argv[idx], "-k") == 0 && idx + 1 < argc) khz = atof(argv[++idx]);
+        else break;
+    }
+    if(idx >= argc || khz <= 0) {
+        fprintf(stderr, "use: %s [-d] [-k kHz] trace.bin [image]\n", argv[0]);
+        return(2);
+    }
+    fp = fopen(argv[idx], "rb");
+    if(fp == NULL) {
+        perror(argv[idx]);
+        return(1);
+    }
+    if(idx + 1 < argc) {
+        memset(dev, 0, sizeof(dev));
+        if(strlen(argv[idx + 1]) >= sizeof(dev->fn)) {
+            fprintf(stderr, "%s: image name too long\n", argv[idx + 1]);
+            return(1);
+        }
+        strcpy(dev->fn, argv[idx + 1]);
+        if(SD_Init(dev) != SD_OK) {
+            fprintf(stderr, "%s: can't open image\n", dev->fn);
+            return(1);
+        }
+        replay = TRUE;
+    }
+
+    while(fread(rec, 1, SD_TRC_REC_SIZE, fp) == SD_TRC_REC_SIZE) {
+        decode(rec, &evt);
+        events++;
+        // Each poll clocks 8 bits
+        us = evt.wait * 8.0 * 1000.0 / khz;
+        switch(evt.type) {
+        case SD_TRC_CMD:
+            if(dump) printf("CMD%-2u arg=%08lX R1=%02X wait=%lu\n", evt.cmd,
+                (unsigned long)evt.arg, evt.res, (unsigned long)evt.wait);
+            stat_add(&stat[PH_CMD], us);
+            stat_add(&cmd_stat[evt.cmd & 0x3F], us);
+            // Bit 7 set: no response. Bits 6..1: errors (bit 0 is idle)
+            if(evt.res & 0xFE) errors++;
+            if(evt.cmd == 24) wsector = evt.arg / SD_BLK_SIZE;
+            break;
+        case SD_TRC_READ:
+            if(dump) printf("  read sector=%lu token=%02X wait=%lu\n",
+                (unsigned long)evt.arg, evt.tkn, (unsigned long)evt.wait);
+            stat_add(&stat[PH_TOKEN], us);
+            if(evt.tkn != 0xFE) errors++;
+            else if(replay) {
+                if(evt.arg > dev->last_sector) { range++; break; }
+                t0 = now_us();
+                if(SD_Read(dev, blk, evt.arg, 0, SD_BLK_SIZE) != SD_OK) errors++;
+                stat_add(&stat[PH_HOST_READ], now_us() - t0);
+            }
+            break;
+        case SD_TRC_WRITE:
+            if(dump) printf("  write token=%02X resp=%02X busy=%lu\n",
+                evt.tkn, evt.res, (unsigned long)evt.wait);
+            if(evt.tkn == 0xFD) break;  // Stop transmission token
+            if(evt.res != 0x05) { errors++; break; }
+            stat_add(&stat[PH_BUSY], us);
+            if(replay) {
+                // The data isn't traced: rewrite what the image already holds
+                if(wsector > dev->last_sector) { range++; break; }
+                t0 = now_us();
+                if((SD_Read(dev, blk, wsector, 0, SD_BLK_SIZE) != SD_OK)
+                    ||(SD_Write(dev, blk, wsector) != SD_OK)) errors++;
+                stat_add(&stat[PH_HOST_WRITE], now_us() - t0);
+            }
+            break;
+        default:
+            fprintf(stderr, "event %lu: unknown type %02X\n", events, evt.type);
+            errors++;
+            break;
+        }
+    }
+    fclose(fp);
+    if(replay) SD_Close(dev);
+
+    printf("%lu events, %lu errors", events, errors);
+    if(replay) printf(", %lu out of range", range);
+    printf("\n\n  %-14s %8s %12s %12s %12s\n", "phase (us)", "count", "min", "avg", "max");
+    for(idx = 0; idx != PH_COUNT; idx++) stat_print(ph_name[idx], &stat[idx]);
+    printf("\n  %-14s %8s %12s %12s %12s\n", "command (us)", "count", "min", "avg", "max");
+    for(idx = 0; idx != 64; idx++) {
+        char name[8];
+        sprintf(name, "CMD%d", idx);
+        stat_print(name, &cmd_stat[idx]);
+    }
+    return(errors ? 1 : 0);
+}
+
+// «sdtrace.c» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/